@@ -13,7 +13,7 @@
 #include <stdio.h>
 
 void
-dump_bmp(const unsigned char *pal, const unsigned char *image_data, unsigned int w, unsigned int h, unsigned int framenum)
+dump_bmp(const unsigned char *pal, const unsigned char *image_data, unsigned int w, unsigned int h, unsigned int stride, unsigned int framenum)
 {
 	int		i;
 	FILE           *fp;
@@ -23,7 +23,8 @@ dump_bmp(const unsigned char *pal, const unsigned char *image_data, unsigned int
 	fp = fopen(filename, "wb");
 	if (!fp) { fprintf(stderr, "Failed to open %s for write\n", filename); return; }
 	fwrite("BM", 2, 1, fp);
-	temp = 1078 + (w * h);
+	/* (BMP rows are padded to 4 bytes, just like the frame's) */
+	temp = 1078 + (stride * h);
 	fwrite(&temp, 4, 1, fp);
 	temp = 0;
 	fwrite(&temp, 4, 1, fp);
@@ -39,7 +40,7 @@ dump_bmp(const unsigned char *pal, const unsigned char *image_data, unsigned int
 	fwrite(&temp, 4, 1, fp);
 	temp = 0;
 	fwrite(&temp, 2, 1, fp);
-	temp = w * h;
+	temp = stride * h;
 	fwrite(&temp, 4, 1, fp);
 	temp = 0;
 	fwrite(&temp, 4, 1, fp);
@@ -59,7 +60,7 @@ dump_bmp(const unsigned char *pal, const unsigned char *image_data, unsigned int
 
 	for (i = h - 1; i >= 0; i--)
 	{
-		fwrite(&image_data[i * w], w, 1, fp);
+		fwrite(&image_data[i * stride], stride, 1, fp);
 	}
 
 	fclose(fp);
@@ -128,7 +129,7 @@ main(int argc, char *argv[])
 	unsigned long	cur_frame;
 
 	smk_info_all(s, &cur_frame, NULL, NULL);
-	dump_bmp(smk_get_palette(s), smk_get_video(s), w, h, cur_frame);
+	dump_bmp(smk_get_palette(s), smk_get_video(s), w, h, smk_get_video_stride(s), cur_frame);
 
 	for (i = 0; i < 7; i++)
 	{
@@ -145,7 +146,7 @@ main(int argc, char *argv[])
 		smk_next(s);
 		/* smk_info_all(s, &cur_frame, NULL, NULL); */
 
-		dump_bmp(smk_get_palette(s), smk_get_video(s), w, h, cur_frame);
+		dump_bmp(smk_get_palette(s), smk_get_video(s), w, h, smk_get_video_stride(s), cur_frame);
 
 		for (i = 0; i < 7; i++)
 		{
@@ -18,13 +18,64 @@
 #include <stdio.h>
 #include <string.h>
 
+/* SIMD block writers: SSE2 is part of x86-64, AVX2 is checked for at
+	open time, NEON is part of AArch64. Define SMK_NO_SIMD (configure
+	--disable-simd) to build with only the portable scalar writers. */
+#if !defined(SMK_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define SMK_HAVE_SSE2
+	#include <emmintrin.h>
+	#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		#define SMK_HAVE_AVX2
+		#include <immintrin.h>
+	#endif
+#endif
+#if !defined(SMK_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(__ARM_BIG_ENDIAN)
+	#define SMK_HAVE_NEON
+	#include <arm_neon.h>
+#endif
+
+/* SMK_MODE_MMAP maps files with POSIX mmap(). Elsewhere, or with
+	SMK_NO_MMAP defined, it falls back to SMK_MODE_MEMORY. */
+#if !defined(SMK_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+	#define SMK_HAVE_MMAP
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+/* Disk mode reads chunks with POSIX pread(), which leaves the stdio
+	file position alone. Elsewhere it falls back to fseek() + fread(). */
+#if defined(__unix__) || defined(__APPLE__)
+	#define SMK_HAVE_PREAD
+	#include <unistd.h>
+#endif
+
+/* Disk-mode read-ahead and SMK_MODE_PROGRESSIVE need pread() and POSIX threads.
+	Define SMK_NO_THREADS (configure --disable-threads) to leave it out. */
+#if defined(SMK_HAVE_PREAD) && !defined(SMK_NO_THREADS)
+	#define SMK_HAVE_THREADS
+	#include <pthread.h>
+#endif
+
+/* The chunk fetch queue (smk_fetch_*) uses Linux io_uring, through raw
+	system calls, when configure finds IORING_OP_READ in <linux/io_uring.h>.
+	Without it, the queue reads on submit. */
+#if defined(__linux__) && defined(SMK_HAVE_PREAD) && HAVE_DECL_IORING_OP_READ && !defined(SMK_NO_IO_URING)
+	#define SMK_HAVE_IO_URING
+	#include <linux/io_uring.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+#endif
+
 /* ************************************************************************* */
 /* BITSTREAM Structure */
 /* ************************************************************************* */
-/* Wraps a block of memory and adds functions to read 1 or 8 bits at a time */
+/* Wraps a block of memory and serves bits from a 64-bit bit buffer.
+	Bits are consumed LSB-first: the next bit in the stream is always
+	bit 0 of "bits", and "count" says how many of them are valid. */
 struct smk_bit_t {
 	const unsigned char * buffer, * end;
-	unsigned int bit_num;
+	unsigned long long bits;
+	unsigned int count;
 };
 
 /* ************************************************************************* */
@@ -36,10 +87,70 @@ static void smk_bs_init(struct smk_bit_t * const bs, const unsigned char * const
 	/* null check */
 	assert(bs);
 	assert(b);
-	/* set up the pointer to bitstream start and end, and set the bit pointer to 0 */
+	/* set up the pointer to bitstream start and end, and empty the bit buffer */
 	bs->buffer = b;
 	bs->end = b + size;
-	bs->bit_num = 0;
+	bs->bits = 0;
+	bs->count = 0;
+}
+
+/* Top up the bit buffer to at least 56 bits, if the input allows.
+	While 8 or more bytes remain this is a single little-endian word
+	load with no bounds checks; only the tail of the input goes byte
+	by byte.
+	Returns the number of bits now available. */
+static unsigned int smk_bs_refill(struct smk_bit_t * const bs)
+{
+	/* null check */
+	assert(bs);
+
+	if (bs->end - bs->buffer >= 8) {
+		/* fast path: load a whole word, keep as many bytes as fit */
+		const unsigned char * const b = bs->buffer;
+		bs->bits |= ((unsigned long long) b[0] |
+				((unsigned long long) b[1] << 8) |
+				((unsigned long long) b[2] << 16) |
+				((unsigned long long) b[3] << 24) |
+				((unsigned long long) b[4] << 32) |
+				((unsigned long long) b[5] << 40) |
+				((unsigned long long) b[6] << 48) |
+				((unsigned long long) b[7] << 56)) << bs->count;
+		bs->buffer += (63 - bs->count) >> 3;
+		bs->count |= 56;
+	} else {
+		/* near the end: feed remaining bytes one at a time */
+		while (bs->count <= 56 && bs->buffer < bs->end) {
+			bs->bits |= (unsigned long long) * bs->buffer << bs->count;
+			bs->buffer ++;
+			bs->count += 8;
+		}
+	}
+
+	return bs->count;
+}
+
+/* Make sure at least n bits (n <= 56) are in the bit buffer.
+	Returns 0 if the bitstream is exhausted before that. */
+static int smk_bs_fill(struct smk_bit_t * const bs, const unsigned int n)
+{
+	assert(n <= 56);
+	return (bs->count >= n || smk_bs_refill(bs) >= n);
+}
+
+/* Return the next n bits (n <= 32) without consuming them.
+	Caller must have checked availability with smk_bs_fill. */
+static unsigned int smk_bs_peek(const struct smk_bit_t * const bs, const unsigned int n)
+{
+	assert(n <= 32 && n <= bs->count);
+	return (unsigned int)(bs->bits & ((1ULL << n) - 1));
+}
+
+/* Drop the next n bits from the bit buffer. */
+static void smk_bs_consume(struct smk_bit_t * const bs, const unsigned int n)
+{
+	assert(n <= bs->count);
+	bs->bits >>= n;
+	bs->count -= n;
 }
 
 /* Reads a bit
@@ -51,22 +162,13 @@ static int smk_bs_read_1(struct smk_bit_t * const bs)
 	assert(bs);
 
 	/* don't die when running out of bits, but signal */
-	if (bs->buffer >= bs->end) {
+	if (! smk_bs_fill(bs, 1)) {
 		fputs("libsmacker::smk_bs_read_1(): ERROR: bitstream exhausted.\n", stderr);
 		return -1;
 	}
 
-	/* get next bit and store for return */
-	ret = (*bs->buffer >> bs->bit_num) & 1;
-
-	/* advance to next bit */
-	if (bs->bit_num >= 7) {
-		/* Out of bits in this byte: next! */
-		bs->buffer ++;
-		bs->bit_num = 0;
-	} else
-		bs->bit_num ++;
-
+	ret = smk_bs_peek(bs, 1);
+	smk_bs_consume(bs, 1);
 	return ret;
 }
 
@@ -74,24 +176,19 @@ static int smk_bs_read_1(struct smk_bit_t * const bs)
 	Returns -1 if error. */
 static int smk_bs_read_8(struct smk_bit_t * const bs)
 {
+	int ret;
 	/* null check */
 	assert(bs);
 
 	/* don't die when running out of bits, but signal */
-	if (bs->buffer + (bs->bit_num > 0) >= bs->end) {
+	if (! smk_bs_fill(bs, 8)) {
 		fputs("libsmacker::smk_bs_read_8(): ERROR: bitstream exhausted.\n", stderr);
 		return -1;
 	}
 
-	if (bs->bit_num) {
-		/* unaligned read */
-		int ret = *bs->buffer >> bs->bit_num;
-		bs->buffer ++;
-		return ret | (*bs->buffer << (8 - bs->bit_num) & 0xFF);
-	}
-
-	/* aligned read */
-	return *bs->buffer++;
+	ret = smk_bs_peek(bs, 8);
+	smk_bs_consume(bs, 8);
+	return ret;
 }
 
 /* ************************************************************************* */
@@ -100,79 +197,162 @@ static int smk_bs_read_8(struct smk_bit_t * const bs)
 #define SMK_HUFF8_BRANCH 0x8000
 #define SMK_HUFF8_LEAF_MASK 0x7FFF
 
+/* Lookup table entries.
+	A leaf entry holds the value in bits 0-7 and the code length in 8-11.
+	SMK_HUFF8_T_WALK marks a code longer than the table: the low bits
+	are then the tree index to continue from, one bit at a time. */
+#define SMK_HUFF8_T_WALK 0x8000
+#define SMK_HUFF8_T_NODE_MASK 0x01FF
+
+/* Widest lookup table for a small tree */
+#define SMK_HUFF8_TABLE_BITS 10
+
 struct smk_huff8_t {
 	/* Unfortunately, smk files do not store the alloc size of a small tree.
 		511 entries is the pessimistic case (N codes and N-1 branches,
 		with N=256 for 8 bits) */
 	size_t size;
 	unsigned short tree[511];
+
+	/* direct-lookup table on the next "bits" bits of input */
+	unsigned int bits;
+	unsigned short table[1 << SMK_HUFF8_TABLE_BITS];
 };
 
 /* ************************************************************************* */
 /* HUFF8 Functions */
 /* ************************************************************************* */
-/* Recursive sub-func for building a tree into an array. */
-static int _smk_huff8_build_rec(struct smk_huff8_t * const t, struct smk_bit_t * const bs)
+/* Sub-func for building a tree into an array.
+	Nodes are stored in pre-order: a branch is followed by its left
+	sub-tree, and holds the index of its right sub-tree.
+	Branches whose left side is still being read are kept on a stack,
+	threaded through their own tree entries (which can't be filled in
+	until the left side is done), so no extra memory or recursion is
+	needed however deep the tree is. */
+#define SMK_HUFF8_STACK_EMPTY 0xFFFF
+static int _smk_huff8_build_tree(struct smk_huff8_t * const t, struct smk_bit_t * const bs)
 {
 	int bit, value;
+	unsigned short top = SMK_HUFF8_STACK_EMPTY;
 	assert(t);
 	assert(bs);
 
-	/* Make sure we aren't running out of bounds */
-	if (t->size >= 511) {
-		fputs("libsmacker::_smk_huff8_build_rec() - ERROR: size exceeded\n", stderr);
-		return 0;
-	}
-
-	/* Read the next bit */
-	if ((bit = smk_bs_read_1(bs)) < 0) {
-		fputs("libsmacker::_smk_huff8_build_rec() - ERROR: get_bit returned -1\n", stderr);
-		return 0;
-	}
-
-	if (bit) {
-		/* Bit set: this forms a Branch node.
-			what we have to do is build the left-hand branch,
-			assign the "jump" address,
-			then build the right hand branch from there.
-		*/
-		/* track the current index */
-		value = t->size ++;
-
-		/* go build the left branch */
-		if (! _smk_huff8_build_rec(t, bs)) {
-			fputs("libsmacker::_smk_huff8_build_rec() - ERROR: failed to build left sub-tree\n", stderr);
+	for (;;) {
+		/* Make sure we aren't running out of bounds */
+		if (t->size >= 511) {
+			fputs("libsmacker::_smk_huff8_build_tree() - ERROR: size exceeded\n", stderr);
 			return 0;
 		}
 
-		/* now go back to our current location, and
-			mark our location as a "jump" */
-		t->tree[value] = SMK_HUFF8_BRANCH | t->size;
-
-		/* continue building the right side */
-		if (! _smk_huff8_build_rec(t, bs)) {
-			fputs("libsmacker::_smk_huff8_build_rec() - ERROR: failed to build right sub-tree\n", stderr);
+		/* Read the next bit */
+		if ((bit = smk_bs_read_1(bs)) < 0) {
+			fputs("libsmacker::_smk_huff8_build_tree() - ERROR: get_bit returned -1\n", stderr);
 			return 0;
 		}
-	} else {
+
+		if (bit) {
+			/* Bit set: this forms a Branch node.
+				Push it, and go build the left-hand branch. */
+			t->tree[t->size] = top;
+			top = (unsigned short)t->size ++;
+			continue;
+		}
+
 		/* Bit unset signifies a Leaf node. */
 		/* Attempt to read value */
 		if ((value = smk_bs_read_8(bs)) < 0) {
-			fputs("libsmacker::_smk_huff8_build_rec() - ERROR: get_byte returned -1\n", stderr);
+			fputs("libsmacker::_smk_huff8_build_tree() - ERROR: get_byte returned -1\n", stderr);
 			return 0;
 		}
 
 		/* store to tree */
 		t->tree[t->size ++] = value;
+
+		/* A leaf completes the left branch of the innermost pending node:
+			mark it as a "jump" to here and build the right-hand branch. */
+		if (top == SMK_HUFF8_STACK_EMPTY)
+			return 1;
+
+		value = top;
+		top = t->tree[value];
+		t->tree[value] = SMK_HUFF8_BRANCH | t->size;
 	}
+}
 
-	return 1;
+/* Fill the direct-lookup table of a finished tree.
+	The table is made no wider than "bits", nor wider than the tree is
+	deep, so callers with few lookups to do can keep the build cheap.
+	Uses an explicit stack, which never holds more than one pending
+	right branch per level. */
+static void smk_huff8_build_table(struct smk_huff8_t * const t, unsigned int bits)
+{
+	unsigned short node[SMK_HUFF8_TABLE_BITS + 1], code[SMK_HUFF8_TABLE_BITS + 1];
+	unsigned char depth[SMK_HUFF8_TABLE_BITS + 1];
+	unsigned int sp, n, d, c, i;
+	/* null check */
+	assert(t);
+
+	if (bits > SMK_HUFF8_TABLE_BITS)
+		bits = SMK_HUFF8_TABLE_BITS;
+
+	/* First pass: how deep does the tree go, up to "bits"? */
+	d = 0;
+	node[0] = 0;
+	depth[0] = 0;
+
+	for (sp = 1; sp > 0 && d < bits;) {
+		sp --;
+		n = node[sp];
+		c = depth[sp];
+
+		while ((t->tree[n] & SMK_HUFF8_BRANCH) && c < bits) {
+			node[sp] = t->tree[n] & SMK_HUFF8_LEAF_MASK;
+			depth[sp] = ++ c;
+			sp ++;
+			n ++;
+		}
+
+		if (c > d)
+			d = c;
+	}
+
+	t->bits = bits = d;
+
+	/* Second pass: each leaf fills every slot whose low bits are its code */
+	node[0] = 0;
+	depth[0] = 0;
+	code[0] = 0;
+
+	for (sp = 1; sp > 0;) {
+		sp --;
+		n = node[sp];
+		d = depth[sp];
+		c = code[sp];
+
+		while ((t->tree[n] & SMK_HUFF8_BRANCH) && d < bits) {
+			/* queue the right branch, go left */
+			node[sp] = t->tree[n] & SMK_HUFF8_LEAF_MASK;
+			depth[sp] = d + 1;
+			code[sp] = c | (1 << d);
+			sp ++;
+			n ++;
+			d ++;
+		}
+
+		if (t->tree[n] & SMK_HUFF8_BRANCH)
+			t->table[c] = SMK_HUFF8_T_WALK | n;
+		else {
+			for (i = c; i < (1U << bits); i += (1U << d))
+				t->table[i] = (d << 8) | t->tree[n];
+		}
+	}
 }
 
 /**
 	Build an 8-bit Hufftree out of a Bitstream.
+	"bits" is the widest lookup table worth building for it.
 */
-static int smk_huff8_build(struct smk_huff8_t * const t, struct smk_bit_t * const bs)
+static int smk_huff8_build(struct smk_huff8_t * const t, struct smk_bit_t * const bs, const unsigned int bits)
 {
 	int bit;
 	/* null check */
@@ -191,7 +371,7 @@ static int smk_huff8_build(struct smk_huff8_t * const t, struct smk_bit_t * cons
 	/* First bit indicates whether a tree is present or not. */
 	/*  Very small or audio-only files may have no tree. */
 	if (bit) {
-		if (! _smk_huff8_build_rec(t, bs)) {
+		if (! _smk_huff8_build_tree(t, bs)) {
 			fputs("libsmacker::smk_huff8_build() - ERROR: tree build failed\n", stderr);
 			return 0;
 		}
@@ -210,6 +390,7 @@ static int smk_huff8_build(struct smk_huff8_t * const t, struct smk_bit_t * cons
 		return 0;
 	}
 
+	smk_huff8_build_table(t, bits);
 	return 1;
 }
 
@@ -217,17 +398,50 @@ static int smk_huff8_build(struct smk_huff8_t * const t, struct smk_bit_t * cons
 	Return -1 on error. */
 static int smk_huff8_lookup(const struct smk_huff8_t * const t, struct smk_bit_t * const bs)
 {
-	int bit, index = 0;
+	int bit;
+	unsigned int entry, index;
 	/* null check */
 	assert(t);
 	assert(bs);
 
+	/* Bits past the end of input read as 0, so the table index is always
+		defined; a code is only accepted if its full length was present. */
+	if (bs->count < t->bits)
+		smk_bs_refill(bs);
+
+	entry = t->table[bs->bits & ((1U << t->bits) - 1)];
+
+	if (!(entry & SMK_HUFF8_T_WALK)) {
+		/* short code: resolved by the table alone */
+		if (bs->count < (entry >> 8)) {
+			fputs("libsmacker::smk_huff8_lookup() - ERROR: bitstream exhausted\n", stderr);
+			return -1;
+		}
+
+		smk_bs_consume(bs, entry >> 8);
+		return entry & 0xFF;
+	}
+
+	/* long code: skip the table bits, walk the rest of the tree */
+	if (bs->count < t->bits) {
+		fputs("libsmacker::smk_huff8_lookup() - ERROR: bitstream exhausted\n", stderr);
+		return -1;
+	}
+
+	smk_bs_consume(bs, t->bits);
+	index = entry & SMK_HUFF8_T_NODE_MASK;
+
 	while (t->tree[index] & SMK_HUFF8_BRANCH) {
-		if ((bit = smk_bs_read_1(bs)) < 0) {
-			fputs("libsmacker::smk_huff8_lookup() - ERROR: get_bit returned -1\n", stderr);
+		/* only touch the input when the bit buffer runs dry */
+		if (bs->count == 0 && smk_bs_refill(bs) == 0) {
+			fputs("libsmacker::smk_huff8_lookup() - ERROR: bitstream exhausted\n", stderr);
 			return -1;
 		}
 
+		bit = (int)(bs->bits & 1);
+		bs->bits >>= 1;
+		bs->count --;
+
 		if (bit) {
 			/* take the right branch */
 			index = t->tree[index] & SMK_HUFF8_LEAF_MASK;
@@ -248,10 +462,32 @@ static int smk_huff8_lookup(const struct smk_huff8_t * const t, struct smk_bit_t
 #define SMK_HUFF16_CACHE     0x40000000
 #define SMK_HUFF16_LEAF_MASK 0x3FFFFFFF
 
+/* Lookup table entries.
+	A leaf entry holds the 16-bit value (or the cache index, if
+	SMK_HUFF16_T_CACHE is set) and the code length in bits 27-30.
+	A link entry points to a secondary table: offset in bits 0-26,
+	width of the secondary table in bits 27-30. */
+#define SMK_HUFF16_T_LINK        0x80000000
+#define SMK_HUFF16_T_CACHE       0x00010000
+#define SMK_HUFF16_T_VALUE_MASK  0x0000FFFF
+#define SMK_HUFF16_T_OFFSET_MASK 0x07FFFFFF
+#define SMK_HUFF16_T_BITS_SHIFT  27
+
+/* Bits resolved by the first-level table, and by each secondary table */
+#define SMK_HUFF16_TABLE_BITS    11
+#define SMK_HUFF16_SUBTABLE_BITS 8
+
 struct smk_huff16_t {
+	/* tree-in-array, only needed while building */
 	unsigned int * tree;
 	size_t size;
 
+	/* multi-level lookup table built from the tree */
+	unsigned int * table;
+	size_t table_size;
+	/* width of the first-level table */
+	unsigned int bits;
+
 	/* recently-used values cache */
 	unsigned short cache[3];
 };
@@ -259,52 +495,44 @@ struct smk_huff16_t {
 /* ************************************************************************* */
 /* HUFF16 Functions */
 /* ************************************************************************* */
-/* Recursive sub-func for building a tree into an array. */
-static int _smk_huff16_build_rec(struct smk_huff16_t * const t, struct smk_bit_t * const bs, const struct smk_huff8_t * const low8, const struct smk_huff8_t * const hi8, const size_t limit)
+/* Sub-func for building a tree into an array.
+	Same scheme as the 8-bit tree: pre-order, with the stack of pending
+	branches threaded through their own entries. Leaf values come from
+	the low8 / hi8 trees, through their lookup tables. */
+#define SMK_HUFF16_STACK_EMPTY 0xFFFFFFFF
+static int _smk_huff16_build_tree(struct smk_huff16_t * const t, struct smk_bit_t * const bs, const struct smk_huff8_t * const low8, const struct smk_huff8_t * const hi8, const size_t limit)
 {
 	int bit, value;
+	unsigned int top = SMK_HUFF16_STACK_EMPTY, next;
 	assert(t);
 	assert(bs);
 	assert(low8);
 	assert(hi8);
 
-	/* Make sure we aren't running out of bounds */
-	if (t->size >= limit) {
-		fputs("libsmacker::_smk_huff16_build_rec() - ERROR: size exceeded\n", stderr);
-		return 0;
-	}
-
-	/* Read the first bit */
-	if ((bit = smk_bs_read_1(bs)) < 0) {
-		fputs("libsmacker::_smk_huff16_build_rec() - ERROR: get_bit returned -1\n", stderr);
-		return 0;
-	}
-
-	if (bit) {
-		/* See tree-in-array explanation for HUFF8 above */
-		/* track the current index */
-		value = t->size ++;
-
-		/* go build the left branch */
-		if (! _smk_huff16_build_rec(t, bs, low8, hi8, limit)) {
-			fputs("libsmacker::_smk_huff16_build_rec() - ERROR: failed to build left sub-tree\n", stderr);
+	for (;;) {
+		/* Make sure we aren't running out of bounds */
+		if (t->size >= limit) {
+			fputs("libsmacker::_smk_huff16_build_tree() - ERROR: size exceeded\n", stderr);
 			return 0;
 		}
 
-		/* now go back to our current location, and
-			mark our location as a "jump" */
-		t->tree[value] = SMK_HUFF16_BRANCH | t->size;
-
-		/* continue building the right side */
-		if (! _smk_huff16_build_rec(t, bs, low8, hi8, limit)) {
-			fputs("libsmacker::_smk_huff16_build_rec() - ERROR: failed to build right sub-tree\n", stderr);
+		/* Read the first bit */
+		if ((bit = smk_bs_read_1(bs)) < 0) {
+			fputs("libsmacker::_smk_huff16_build_tree() - ERROR: get_bit returned -1\n", stderr);
 			return 0;
 		}
-	} else {
+
+		if (bit) {
+			/* Branch: push, and go build the left branch */
+			t->tree[t->size] = top;
+			top = (unsigned int)t->size ++;
+			continue;
+		}
+
 		/* Bit unset signifies a Leaf node. */
 		/* Attempt to read LOW value */
 		if ((value = smk_huff8_lookup(low8, bs)) < 0) {
-			fputs("libsmacker::_smk_huff16_build_rec() - ERROR: get LOW value returned -1\n", stderr);
+			fputs("libsmacker::_smk_huff16_build_tree() - ERROR: get LOW value returned -1\n", stderr);
 			return 0;
 		}
 
@@ -312,7 +540,7 @@ static int _smk_huff16_build_rec(struct smk_huff16_t * const t, struct smk_bit_t
 
 		/* now read HIGH value */
 		if ((value = smk_huff8_lookup(hi8, bs)) < 0) {
-			fputs("libsmacker::_smk_huff16_build_rec() - ERROR: get HIGH value returned -1\n", stderr);
+			fputs("libsmacker::_smk_huff16_build_tree() - ERROR: get HIGH value returned -1\n", stderr);
 			return 0;
 		}
 
@@ -329,9 +557,136 @@ static int _smk_huff16_build_rec(struct smk_huff16_t * const t, struct smk_bit_t
 			t->tree[t->size] = SMK_HUFF16_CACHE | 2;
 
 		t->size ++;
+
+		/* Left branch of the innermost pending node is complete:
+			mark it as a "jump" to here and continue on its right side. */
+		if (top == SMK_HUFF16_STACK_EMPTY)
+			return 1;
+
+		next = t->tree[top];
+		t->tree[top] = SMK_HUFF16_BRANCH | t->size;
+		top = next;
+	}
+}
+
+/* Depth of the subtree at node, but no deeper than limit. */
+static unsigned int _smk_huff16_depth(const unsigned int * const tree, const size_t node, const unsigned int limit)
+{
+	unsigned int l, r;
+
+	if (limit == 0 || !(tree[node] & SMK_HUFF16_BRANCH))
+		return 0;
+
+	l = _smk_huff16_depth(tree, node + 1, limit - 1);
+	r = _smk_huff16_depth(tree, tree[node] & SMK_HUFF16_LEAF_MASK, limit - 1);
+	return 1 + (l > r ? l : r);
+}
+
+/* Build the multi-level lookup table from the tree-in-array.
+	Each table is filled by walking the tree once per index, so the
+	work per table is bounded by its width and no recursion is needed.
+	Branches still open after a table's width become links to a
+	secondary table, which is queued and filled in turn. */
+static int smk_huff16_build_table(struct smk_huff16_t * const t)
+{
+	/* queue of tables still to fill: tree node, table offset, width */
+	struct smk_huff16_pending_t {
+		size_t node;
+		size_t offset;
+		unsigned int bits;
+	} * pending = NULL;
+	size_t pending_count, pending_alloc, head, table_alloc, code, node;
+	unsigned int d, bits;
+	void * temp;
+	/* null check */
+	assert(t);
+	assert(t->tree);
+
+	/* first-level table: no wider than the tree is deep */
+	t->bits = _smk_huff16_depth(t->tree, 0, SMK_HUFF16_TABLE_BITS);
+	t->table_size = (size_t)1 << t->bits;
+	table_alloc = t->table_size;
+	pending_alloc = 16;
+	pending_count = 1;
+
+	if ((t->table = malloc(table_alloc * sizeof(unsigned int))) == NULL ||
+		(pending = malloc(pending_alloc * sizeof(struct smk_huff16_pending_t))) == NULL) {
+		perror("libsmacker::smk_huff16_build_table() - ERROR: failed to malloc() lookup table");
+		goto error;
+	}
+
+	pending[0].node = 0;
+	pending[0].offset = 0;
+	pending[0].bits = t->bits;
+
+	for (head = 0; head < pending_count; head ++) {
+		bits = pending[head].bits;
+
+		for (code = 0; code < ((size_t)1 << bits); code ++) {
+			/* walk down from the table's root node, LSB of code first */
+			node = pending[head].node;
+
+			for (d = 0; d < bits && (t->tree[node] & SMK_HUFF16_BRANCH); d ++) {
+				if ((code >> d) & 1)
+					node = t->tree[node] & SMK_HUFF16_LEAF_MASK;
+				else
+					node ++;
+			}
+
+			if (!(t->tree[node] & SMK_HUFF16_BRANCH)) {
+				/* Leaf: store value (or cache index) and code length */
+				t->table[pending[head].offset + code] = (d << SMK_HUFF16_T_BITS_SHIFT) |
+					((t->tree[node] & SMK_HUFF16_CACHE) ? (SMK_HUFF16_T_CACHE | (t->tree[node] & 3)) : (t->tree[node] & SMK_HUFF16_T_VALUE_MASK));
+				continue;
+			}
+
+			/* Code continues past this table: link to a new secondary table */
+			d = _smk_huff16_depth(t->tree, node, SMK_HUFF16_SUBTABLE_BITS);
+
+			if (t->table_size + ((size_t)1 << d) > (size_t)SMK_HUFF16_T_OFFSET_MASK + 1) {
+				fputs("libsmacker::smk_huff16_build_table() - ERROR: lookup table too large\n", stderr);
+				goto error;
+			}
+
+			if (t->table_size + ((size_t)1 << d) > table_alloc) {
+				while (t->table_size + ((size_t)1 << d) > table_alloc)
+					table_alloc <<= 1;
+
+				if ((temp = realloc(t->table, table_alloc * sizeof(unsigned int))) == NULL) {
+					perror("libsmacker::smk_huff16_build_table() - ERROR: failed to realloc() lookup table");
+					goto error;
+				}
+
+				t->table = temp;
+			}
+
+			if (pending_count == pending_alloc) {
+				pending_alloc <<= 1;
+
+				if ((temp = realloc(pending, pending_alloc * sizeof(struct smk_huff16_pending_t))) == NULL) {
+					perror("libsmacker::smk_huff16_build_table() - ERROR: failed to realloc() pending list");
+					goto error;
+				}
+
+				pending = temp;
+			}
+
+			t->table[pending[head].offset + code] = SMK_HUFF16_T_LINK | (d << SMK_HUFF16_T_BITS_SHIFT) | t->table_size;
+			pending[pending_count].node = node;
+			pending[pending_count].offset = t->table_size;
+			pending[pending_count].bits = d;
+			pending_count ++;
+			t->table_size += (size_t)1 << d;
+		}
 	}
 
+	free(pending);
 	return 1;
+error:
+	free(pending);
+	free(t->table);
+	t->table = NULL;
+	return 0;
 }
 
 /* Entry point for building a big 16-bit tree. */
@@ -356,13 +711,13 @@ static int smk_huff16_build(struct smk_huff16_t * const t, struct smk_bit_t * co
 	/*  Very small or audio-only files may have no tree. */
 	if (bit) {
 		/* build low-8-bits tree */
-		if (! smk_huff8_build(&low8, bs)) {
+		if (! smk_huff8_build(&low8, bs, SMK_HUFF8_TABLE_BITS)) {
 			fputs("libsmacker::smk_huff16_build() - ERROR: failed to build LOW tree\n", stderr);
 			return 0;
 		}
 
 		/* build hi-8-bits tree */
-		if (! smk_huff8_build(&hi8, bs)) {
+		if (! smk_huff8_build(&hi8, bs, SMK_HUFF8_TABLE_BITS)) {
 			fputs("libsmacker::smk_huff16_build() - ERROR: failed to build HIGH tree\n", stderr);
 			return 0;
 		}
@@ -398,8 +753,8 @@ static int smk_huff16_build(struct smk_huff16_t * const t, struct smk_bit_t * co
 			return 0;
 		}
 
-		/* Finally, call recursive function to retrieve the Bigtree. */
-		if (! _smk_huff16_build_rec(t, bs, &low8, &hi8, limit)) {
+		/* Finally, retrieve the Bigtree. */
+		if (! _smk_huff16_build_tree(t, bs, &low8, &hi8, limit)) {
 			fputs("libsmacker::smk_huff16_build() - ERROR: failed to build huff16 tree\n", stderr);
 			free(t->tree);
 			t->tree = NULL;
@@ -439,6 +794,16 @@ static int smk_huff16_build(struct smk_huff16_t * const t, struct smk_bit_t * co
 		return 0;
 	}
 
+	/* Convert to lookup tables: the tree itself is not needed after this. */
+	if (! smk_huff16_build_table(t)) {
+		fputs("libsmacker::smk_huff16_build() - ERROR: failed to build lookup table\n", stderr);
+		free(t->tree);
+		t->tree = NULL;
+		return 0;
+	}
+
+	free(t->tree);
+	t->tree = NULL;
 	return 1;
 }
 
@@ -447,32 +812,55 @@ static int smk_huff16_build(struct smk_huff16_t * const t, struct smk_bit_t * co
 	Note that this also updates the recently-used-values cache. */
 static int smk_huff16_lookup(struct smk_huff16_t * const t, struct smk_bit_t * const bs)
 {
-	int bit, value, index = 0;
+	const unsigned int * table;
+	unsigned int entry, bits;
+	int value;
 	/* null check */
 	assert(t);
 	assert(bs);
 
-	while (t->tree[index] & SMK_HUFF16_BRANCH) {
-		if ((bit = smk_bs_read_1(bs)) < 0) {
-			fputs("libsmacker::smk_huff16_lookup() - ERROR: get_bit returned -1\n", stderr);
+	table = t->table;
+	bits = t->bits;
+
+	/* Bits past the end of input read as 0, so the table index is always
+		defined; a code is only accepted if its full length was present. */
+	if (bs->count < bits)
+		smk_bs_refill(bs);
+
+	entry = table[bs->bits & ((1U << bits) - 1)];
+
+	while (entry & SMK_HUFF16_T_LINK) {
+		/* long code: step into the secondary table */
+		if (bs->count < bits) {
+			fputs("libsmacker::smk_huff16_lookup() - ERROR: bitstream exhausted\n", stderr);
 			return -1;
 		}
 
-		if (bit) {
-			/* take the right branch */
-			index = t->tree[index] & SMK_HUFF16_LEAF_MASK;
-		} else {
-			/* take the left branch */
-			index ++;
-		}
+		smk_bs_consume(bs, bits);
+		table = t->table + (entry & SMK_HUFF16_T_OFFSET_MASK);
+		bits = entry >> SMK_HUFF16_T_BITS_SHIFT & 0x0F;
+
+		if (bs->count < bits)
+			smk_bs_refill(bs);
+
+		entry = table[bs->bits & ((1U << bits) - 1)];
+	}
+
+	bits = entry >> SMK_HUFF16_T_BITS_SHIFT & 0x0F;
+
+	if (bs->count < bits) {
+		fputs("libsmacker::smk_huff16_lookup() - ERROR: bitstream exhausted\n", stderr);
+		return -1;
 	}
 
+	smk_bs_consume(bs, bits);
+
 	/* Get the value at this point */
-	value = t->tree[index];
+	value = entry & SMK_HUFF16_T_VALUE_MASK;
 
-	if (value & SMK_HUFF16_CACHE) {
+	if (entry & SMK_HUFF16_T_CACHE) {
 		/* uses cached value instead of actual value */
-		value = t->cache[value & SMK_HUFF16_LEAF_MASK];
+		value = t->cache[value];
 	}
 
 	if (t->cache[0] != value) {
@@ -487,90 +875,546 @@ static int smk_huff16_lookup(struct smk_huff16_t * const t, struct smk_bit_t * c
 }
 
 /* ************************************************************************* */
-/* SMACKER Structure */
+/* BLOCK WRITER Structure */
 /* ************************************************************************* */
-/* tree processing order */
-#define SMK_TREE_MMAP	0
-#define SMK_TREE_MCLR	1
-#define SMK_TREE_FULL	2
-#define SMK_TREE_TYPE	3
+/* Writers for the 4x4 video blocks, all taking a pointer to the block's
+	top-left pixel and the frame stride.
+	Pixel pairs are given as 16-bit values: low byte is the left pixel.
+	One set of writers is picked per smk at open time. */
+struct smk_blocks_t {
+	/* MONO: bit N of map picks s1 (set) or s2 (clear) for pixel N */
+	void (* mono)(unsigned char * t, unsigned long stride, unsigned char s1, unsigned char s2, unsigned int map);
+	/* FULL: 4 rows of 2 pixel pairs */
+	void (* full)(unsigned char * t, unsigned long stride, const unsigned short px[8]);
+	/* V4 DOUBLE: 2 pixel pairs, each doubled to a 4x2 area */
+	void (* dbl)(unsigned char * t, unsigned long stride, const unsigned short px[2]);
+	/* V4 HALF: 2 rows of 2 pixel pairs, each row doubled */
+	void (* half)(unsigned char * t, unsigned long stride, const unsigned short px[4]);
+	/* SOLID: n blocks side by side, all color c */
+	void (* solid)(unsigned char * t, unsigned long stride, unsigned char c, unsigned long n);
+};
 
-struct smk_t {
-	/* meta-info */
-	/* file mode: see flags, smacker.h */
-	unsigned char	mode;
+/* ************************************************************************* */
+/* BLOCK WRITER Functions */
+/* ************************************************************************* */
+/* Portable writers: one 4-byte store per row */
+static void smk_scalar_mono(unsigned char * t, const unsigned long stride, const unsigned char s1, const unsigned char s2, unsigned int map)
+{
+	/* nibble of the map -> byte mask, in memory byte order */
+	static const unsigned char monomask[16][4] = {
+		{0x00, 0x00, 0x00, 0x00}, {0xFF, 0x00, 0x00, 0x00}, {0x00, 0xFF, 0x00, 0x00}, {0xFF, 0xFF, 0x00, 0x00},
+		{0x00, 0x00, 0xFF, 0x00}, {0xFF, 0x00, 0xFF, 0x00}, {0x00, 0xFF, 0xFF, 0x00}, {0xFF, 0xFF, 0xFF, 0x00},
+		{0x00, 0x00, 0x00, 0xFF}, {0xFF, 0x00, 0x00, 0xFF}, {0x00, 0xFF, 0x00, 0xFF}, {0xFF, 0xFF, 0x00, 0xFF},
+		{0x00, 0x00, 0xFF, 0xFF}, {0xFF, 0x00, 0xFF, 0xFF}, {0x00, 0xFF, 0xFF, 0xFF}, {0xFF, 0xFF, 0xFF, 0xFF}
+	};
+	const unsigned int c1 = s1 * 0x01010101U, c2 = s2 * 0x01010101U;
+	unsigned int mask, c, k;
+
+	for (k = 0; k < 4; k ++) {
+		memcpy(&mask, monomask[map & 0x0F], 4);
+		c = (c1 & mask) | (c2 & ~mask);
+		memcpy(t, &c, 4);
+		map >>= 4;
+		t += stride;
+	}
+}
 
-	/* microsec per frame - stored as a double to handle scaling
-		(large positive millisec / frame values may overflow a ul) */
-	double	usf;
+static void smk_scalar_full(unsigned char * t, const unsigned long stride, const unsigned short px[8])
+{
+	unsigned char r[4];
+	unsigned int k;
+
+	for (k = 0; k < 8; k += 2) {
+		r[0] = px[k] & 0xFF;
+		r[1] = px[k] >> 8;
+		r[2] = px[k + 1] & 0xFF;
+		r[3] = px[k + 1] >> 8;
+		memcpy(t, r, 4);
+		t += stride;
+	}
+}
 
-	/* total frames */
-	unsigned long	f;
-	/* does file have a ring frame? (in other words, does file loop?) */
-	unsigned char	ring_frame;
+static void smk_scalar_dbl(unsigned char * t, const unsigned long stride, const unsigned short px[2])
+{
+	unsigned char r[4];
+	unsigned int k;
+
+	for (k = 0; k < 2; k ++) {
+		r[0] = r[1] = px[k] & 0xFF;
+		r[2] = r[3] = px[k] >> 8;
+		memcpy(t, r, 4);
+		memcpy(t + stride, r, 4);
+		t += (stride << 1);
+	}
+}
 
-	/* Index of current frame */
-	unsigned long	cur_frame;
+static void smk_scalar_half(unsigned char * t, const unsigned long stride, const unsigned short px[4])
+{
+	unsigned char r[4];
+	unsigned int k;
+
+	for (k = 0; k < 4; k += 2) {
+		r[0] = px[k] & 0xFF;
+		r[1] = px[k] >> 8;
+		r[2] = px[k + 1] & 0xFF;
+		r[3] = px[k + 1] >> 8;
+		memcpy(t, r, 4);
+		memcpy(t + stride, r, 4);
+		t += (stride << 1);
+	}
+}
 
-	/* SOURCE union.
-		Where the data is going to be read from (or be stored),
-		depending on the file mode. */
-	union {
-		struct {
-			/* on-disk mode */
-			FILE * fp;
-			unsigned long * chunk_offset;
-		} file;
+static void smk_scalar_solid(unsigned char * t, const unsigned long stride, const unsigned char c, const unsigned long n)
+{
+	memset(t, c, n << 2);
+	t += stride;
+	memset(t, c, n << 2);
+	t += stride;
+	memset(t, c, n << 2);
+	t += stride;
+	memset(t, c, n << 2);
+}
 
-		/* in-memory mode: unprocessed chunks */
-		unsigned char ** chunk_data;
-	} source;
+static const struct smk_blocks_t smk_blocks_scalar = {
+	smk_scalar_mono, smk_scalar_full, smk_scalar_dbl, smk_scalar_half, smk_scalar_solid
+};
 
-	/* shared array of "chunk sizes"*/
-	unsigned long * chunk_size;
+#ifdef SMK_HAVE_SSE2
+/* SSE2 writers: build the whole 4x4 block in one register */
+static void smk_sse2_store(unsigned char * t, const unsigned long stride, __m128i v)
+{
+	int r;
+	r = _mm_cvtsi128_si32(v);
+	memcpy(t, &r, 4);
+	v = _mm_srli_si128(v, 4);
+	r = _mm_cvtsi128_si32(v);
+	memcpy(t + stride, &r, 4);
+	v = _mm_srli_si128(v, 4);
+	r = _mm_cvtsi128_si32(v);
+	memcpy(t + 2 * stride, &r, 4);
+	v = _mm_srli_si128(v, 4);
+	r = _mm_cvtsi128_si32(v);
+	memcpy(t + 3 * stride, &r, 4);
+}
 
-	/* Holds per-frame flags (i.e. 'keyframe') */
-	unsigned char * keyframe;
-	/* Holds per-frame type mask (e.g. 'audio track 3, 2, and palette swap') */
-	unsigned char * frame_type;
+static void smk_sse2_mono(unsigned char * t, const unsigned long stride, const unsigned char s1, const unsigned char s2, const unsigned int map)
+{
+	const __m128i bits = _mm_set_epi8((char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+			(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	const int lo = (int)((map & 0xFF) * 0x01010101U), hi = (int)(((map >> 8) & 0xFF) * 0x01010101U);
+	__m128i m = _mm_and_si128(_mm_set_epi32(hi, hi, lo, lo), bits);
+	/* compare-select: 0xFF where the map bit is set */
+	m = _mm_cmpeq_epi8(m, bits);
+	smk_sse2_store(t, stride, _mm_or_si128(_mm_and_si128(m, _mm_set1_epi8((char)s1)),
+			_mm_andnot_si128(m, _mm_set1_epi8((char)s2))));
+}
 
-	/* video and audio structures */
-	/* Video data type: enable/disable decode switch,
-		video info and flags,
-		pointer to last-decoded-palette */
-	struct smk_video_t {
-		/* enable/disable decode switch */
-		unsigned char enable;
+static void smk_sse2_full(unsigned char * t, const unsigned long stride, const unsigned short px[8])
+{
+	smk_sse2_store(t, stride, _mm_loadu_si128((const __m128i *)px));
+}
 
-		/* video info */
-		unsigned long	w;
-		unsigned long	h;
-		/* Y scale mode (constants defined in smacker.h)
-			0: unscaled
-			1: doubled
-			2: interlaced */
-		unsigned char	y_scale_mode;
+static void smk_sse2_dbl(unsigned char * t, const unsigned long stride, const unsigned short px[2])
+{
+	/* duplicate every byte, then every row */
+	__m128i v = _mm_cvtsi32_si128((int)(px[0] | ((unsigned int)px[1] << 16)));
+	v = _mm_unpacklo_epi8(v, v);
+	smk_sse2_store(t, stride, _mm_unpacklo_epi32(v, v));
+}
 
-		/* version ('2' or '4') */
-		unsigned char	v;
+static void smk_sse2_half(unsigned char * t, const unsigned long stride, const unsigned short px[4])
+{
+	__m128i v = _mm_loadl_epi64((const __m128i *)px);
+	smk_sse2_store(t, stride, _mm_unpacklo_epi32(v, v));
+}
 
-		/* Huffman trees */
-		unsigned long tree_size[4];
-		struct smk_huff16_t tree[4];
+static void smk_sse2_solid(unsigned char * t, const unsigned long stride, const unsigned char c, const unsigned long n)
+{
+	const __m128i v = _mm_set1_epi8((char)c);
+	const int r = (int)(c * 0x01010101U);
+	unsigned long i, k;
 
-		/* Palette data type: pointer to last-decoded-palette */
-		unsigned char palette[256][3];
-		/* Last-unpacked frame */
-		unsigned char * frame;
-	} video;
+	for (k = 0; k < 4; k ++) {
+		for (i = 0; i + 4 <= n; i += 4)
+			_mm_storeu_si128((__m128i *)(t + (i << 2)), v);
 
-	/* audio structure */
-	struct smk_audio_t {
-		/* set if track exists in file */
-		unsigned char exists;
+		for (; i < n; i ++)
+			memcpy(t + (i << 2), &r, 4);
 
-		/* enable/disable switch (per track) */
-		unsigned char enable;
+		t += stride;
+	}
+}
+
+static const struct smk_blocks_t smk_blocks_sse2 = {
+	smk_sse2_mono, smk_sse2_full, smk_sse2_dbl, smk_sse2_half, smk_sse2_solid
+};
+#endif
+
+#ifdef SMK_HAVE_AVX2
+/* AVX2 only pays off for wide spans: the single blocks stay on SSE2 */
+__attribute__((target("avx2")))
+static void smk_avx2_solid(unsigned char * t, const unsigned long stride, const unsigned char c, const unsigned long n)
+{
+	const __m256i v = _mm256_set1_epi8((char)c);
+	const int r = (int)(c * 0x01010101U);
+	unsigned long i, k;
+
+	for (k = 0; k < 4; k ++) {
+		for (i = 0; i + 8 <= n; i += 8)
+			_mm256_storeu_si256((__m256i *)(t + (i << 2)), v);
+
+		if (i + 4 <= n) {
+			_mm_storeu_si128((__m128i *)(t + (i << 2)), _mm256_castsi256_si128(v));
+			i += 4;
+		}
+
+		for (; i < n; i ++)
+			memcpy(t + (i << 2), &r, 4);
+
+		t += stride;
+	}
+}
+
+static const struct smk_blocks_t smk_blocks_avx2 = {
+	smk_sse2_mono, smk_sse2_full, smk_sse2_dbl, smk_sse2_half, smk_avx2_solid
+};
+#endif
+
+#ifdef SMK_HAVE_NEON
+/* NEON writers: same layout as SSE2 */
+static void smk_neon_store(unsigned char * t, const unsigned long stride, const uint8x16_t v)
+{
+	const uint32x4_t w = vreinterpretq_u32_u8(v);
+	uint32_t r;
+	r = vgetq_lane_u32(w, 0);
+	memcpy(t, &r, 4);
+	r = vgetq_lane_u32(w, 1);
+	memcpy(t + stride, &r, 4);
+	r = vgetq_lane_u32(w, 2);
+	memcpy(t + 2 * stride, &r, 4);
+	r = vgetq_lane_u32(w, 3);
+	memcpy(t + 3 * stride, &r, 4);
+}
+
+static void smk_neon_mono(unsigned char * t, const unsigned long stride, const unsigned char s1, const unsigned char s2, const unsigned int map)
+{
+	static const uint8_t bits[16] = {
+		0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+		0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80
+	};
+	const uint8x16_t m = vtstq_u8(vcombine_u8(vdup_n_u8(map & 0xFF), vdup_n_u8((map >> 8) & 0xFF)), vld1q_u8(bits));
+	smk_neon_store(t, stride, vbslq_u8(m, vdupq_n_u8(s1), vdupq_n_u8(s2)));
+}
+
+static void smk_neon_full(unsigned char * t, const unsigned long stride, const unsigned short px[8])
+{
+	smk_neon_store(t, stride, vld1q_u8((const uint8_t *)px));
+}
+
+static void smk_neon_dbl(unsigned char * t, const unsigned long stride, const unsigned short px[2])
+{
+	const uint8x8_t v = vreinterpret_u8_u32(vdup_n_u32(px[0] | ((uint32_t)px[1] << 16)));
+	const uint8x8x2_t d = vzip_u8(v, v);
+	const uint32x2_t w = vreinterpret_u32_u8(d.val[0]);
+	smk_neon_store(t, stride, vreinterpretq_u8_u32(vcombine_u32(vdup_lane_u32(w, 0), vdup_lane_u32(w, 1))));
+}
+
+static void smk_neon_half(unsigned char * t, const unsigned long stride, const unsigned short px[4])
+{
+	const uint32x2_t w = vreinterpret_u32_u8(vld1_u8((const uint8_t *)px));
+	smk_neon_store(t, stride, vreinterpretq_u8_u32(vcombine_u32(vdup_lane_u32(w, 0), vdup_lane_u32(w, 1))));
+}
+
+static void smk_neon_solid(unsigned char * t, const unsigned long stride, const unsigned char c, const unsigned long n)
+{
+	const uint8x16_t v = vdupq_n_u8(c);
+	const uint32_t r = c * 0x01010101U;
+	unsigned long i, k;
+
+	for (k = 0; k < 4; k ++) {
+		for (i = 0; i + 4 <= n; i += 4)
+			vst1q_u8(t + (i << 2), v);
+
+		for (; i < n; i ++)
+			memcpy(t + (i << 2), &r, 4);
+
+		t += stride;
+	}
+}
+
+static const struct smk_blocks_t smk_blocks_neon = {
+	smk_neon_mono, smk_neon_full, smk_neon_dbl, smk_neon_half, smk_neon_solid
+};
+#endif
+
+/* Pick the best block writers this CPU supports. */
+static const struct smk_blocks_t * smk_blocks_select(void)
+{
+	const struct smk_blocks_t * blocks = &smk_blocks_scalar;
+#if defined(SMK_HAVE_SSE2)
+	blocks = &smk_blocks_sse2;
+#elif defined(SMK_HAVE_NEON)
+	blocks = &smk_blocks_neon;
+#endif
+#ifdef SMK_HAVE_AVX2
+
+	if (__builtin_cpu_supports("avx2"))
+		blocks = &smk_blocks_avx2;
+
+#endif
+	return blocks;
+}
+
+/* ************************************************************************* */
+/* COLOR CONVERSION Functions */
+/* ************************************************************************* */
+/* Convert an area of the indexed frame, npix wide and nrows high,
+	to 32-bit pixels through the packed palette */
+static void smk_convert32(const unsigned char * idx, const unsigned long istride, unsigned char * out, const unsigned long ostride, const unsigned int * packed, const unsigned long npix, unsigned long nrows)
+{
+	unsigned long i;
+
+	for (; nrows > 0; nrows --) {
+		for (i = 0; i < npix; i ++)
+			memcpy(out + (i << 2), &packed[idx[i]], 4);
+
+		idx += istride;
+		out += ostride;
+	}
+}
+
+/* Same, to 16-bit pixels */
+static void smk_convert16(const unsigned char * idx, const unsigned long istride, unsigned char * out, const unsigned long ostride, const unsigned int * packed, const unsigned long npix, unsigned long nrows)
+{
+	unsigned long i;
+	unsigned short c;
+
+	for (; nrows > 0; nrows --) {
+		for (i = 0; i < npix; i ++) {
+			c = (unsigned short)packed[idx[i]];
+			memcpy(out + (i << 1), &c, 2);
+		}
+
+		idx += istride;
+		out += ostride;
+	}
+}
+
+/* ************************************************************************* */
+/* SMACKER Structure */
+/* ************************************************************************* */
+/* tree processing order */
+#define SMK_TREE_MMAP	0
+#define SMK_TREE_MCLR	1
+#define SMK_TREE_FULL	2
+#define SMK_TREE_TYPE	3
+
+/* Where entropy decoding of a frame stands as a block row begins:
+	everything needed to pick it up from there (see struct smk_index_t) */
+struct smk_mark_t {
+	/* bits read from the video record */
+	unsigned long bit;
+	/* the tree caches */
+	unsigned short cache[4][3];
+	/* the run reaching into the row: blocks left in it, type and data */
+	unsigned short left;
+	unsigned char type;
+	unsigned char typedata;
+};
+
+/* index frame states */
+#define SMK_INDEX_NONE	0
+#define SMK_INDEX_RECORDED	1
+/* from a sidecar file, and not yet checked against the video record */
+#define SMK_INDEX_LOADED	2
+
+struct smk_t {
+	/* meta-info */
+	/* file mode: see flags, smacker.h */
+	unsigned char	mode;
+
+	/* microsec per frame - stored as a double to handle scaling
+		(large positive millisec / frame values may overflow a ul) */
+	double	usf;
+
+	/* total frames */
+	unsigned long	f;
+	/* does file have a ring frame? (in other words, does file loop?) */
+	unsigned char	ring_frame;
+
+	/* Index of current frame */
+	unsigned long	cur_frame;
+
+	/* SOURCE.
+		Where the data is going to be read from (or be stored),
+		depending on the file mode. */
+	struct {
+		/* Where chunks come from: the callbacks given to smk_open_io,
+			or built-in ones for a FILE * or memory buffer.
+			Kept for disk and mmap modes; in-memory mode is done
+			with them once open. */
+		struct smk_io_t io;
+		void * user;
+
+		struct {
+			/* on-disk mode */
+			unsigned long * chunk_offset;
+			/* chunk read buffer, big enough for the largest chunk */
+			unsigned char * buffer;
+			unsigned long buffer_size;
+			/* smk_fetch queue this has a read queued on, or waiting
+				to be collected from; that read's frame, state
+				(SMK_FETCH_*) and buffer, the size of "buffer" */
+			struct smk_fetch_t * fetch;
+			unsigned long fetch_frame;
+			unsigned char fetch_state;
+			unsigned char * fetch_buffer;
+#ifdef SMK_HAVE_THREADS
+			/* read-ahead, if turned on */
+			struct smk_readahead_t * ra;
+#endif
+		} file;
+
+		/* in-memory mode: unprocessed chunks, pointers into "arena"
+			(mmap mode: pointers into memory from io.map) */
+		unsigned char ** chunk_data;
+
+		/* in-memory mode: all chunks, back to back */
+		unsigned char * arena;
+#ifdef SMK_HAVE_THREADS
+		/* progressive mode: the thread still filling "arena" */
+		struct smk_load_t * load;
+#endif
+	} source;
+
+	/* shared array of "chunk sizes"*/
+	unsigned long * chunk_size;
+
+	/* Holds per-frame flags (i.e. 'keyframe') */
+	unsigned char * keyframe;
+	/* Holds per-frame type mask (e.g. 'audio track 3, 2, and palette swap') */
+	unsigned char * frame_type;
+
+	/* video and audio structures */
+	/* Video data type: enable/disable decode switch,
+		video info and flags,
+		pointer to last-decoded-palette */
+	struct smk_video_t {
+		/* enable/disable decode switch */
+		unsigned char enable;
+
+		/* video info */
+		unsigned long	w;
+		unsigned long	h;
+		/* Y scale mode (constants defined in smacker.h)
+			0: unscaled
+			1: doubled
+			2: interlaced */
+		unsigned char	y_scale_mode;
+
+		/* version ('2' or '4') */
+		unsigned char	v;
+
+		/* Huffman trees */
+		unsigned long tree_size[4];
+		struct smk_huff16_t tree[4];
+
+		/* Palette data type: pointer to last-decoded-palette */
+		unsigned char palette[256][3];
+		/* Last-unpacked frame, and its row pitch: w rounded up to whole
+			blocks, so the last block in a row stays inside it */
+		unsigned char * frame;
+		unsigned long pitch;
+
+		/* Where frames are output to, and the row pitch in bytes:
+			"frame" above, the internal "color" buffer, or a buffer
+			the caller handed over with smk_set_video_target */
+		unsigned char * target;
+		unsigned long stride;
+
+		/* Output format (SMK_VIDEO_*, without SMK_VIDEO_COLORKEY),
+			and its bytes per pixel.
+			For anything but SMK_VIDEO_INDEXED, indices are still decoded
+			to "frame", and each block written is converted to "target"
+			right away. */
+		unsigned char format;
+		unsigned char colorkey;
+		unsigned char bpp;
+		void (* convert)(const unsigned char * idx, unsigned long istride, unsigned char * out, unsigned long ostride, const unsigned int * packed, unsigned long npix, unsigned long nrows);
+
+		/* Caller's output buffer (or NULL), and the internal one for color formats */
+		unsigned char * user_target;
+		unsigned long user_stride;
+		unsigned char * color;
+
+		/* Palette as RGBA bytes, and packed into the output format.
+			Kept up to date entry by entry as palette records arrive. */
+		unsigned char palette_rgba[256][4];
+		unsigned int palette_packed[256];
+		/* set when the last palette record changed anything */
+		unsigned char palette_changed;
+
+		/* Blocks the last decoded frame wrote, one byte per 4x4 block,
+			row by row (VOID blocks stay 0) */
+		unsigned char * dirty;
+		/* ...and merged into rectangles of x, y, w, h pixels,
+			built from "dirty" on request */
+		unsigned long * dirty_rect;
+		unsigned long dirty_rect_count;
+		unsigned char dirty_rect_valid;
+
+		/* block writers for this CPU */
+		const struct smk_blocks_t * blocks;
+
+		/* A frame's video, entropy-decoded into block commands: a run
+			of blocks of one type is a header (type | color << 8, then the
+			block count) followed by each block's values from the trees
+			(MONO: colors, map; FULL: 8; DOUBLE: 2; HALF: 4; VOID and
+			SOLID: none). Runs are split where they cross block rows,
+			so there are never more commands than blocks, and each block
+			row starts a command: "row" has where, for the "rows" begun. */
+		struct smk_cmds_t {
+			unsigned short * cmd;
+			unsigned long len;
+			unsigned long * row;
+			unsigned long rows;
+			/* the bitstream failed: "cmd" has the blocks before that */
+			unsigned char failed;
+		} cmds;
+
+		/* Entropy index (smk_set_index): a checkpoint every "interval"
+			block rows of each frame, taken the first time it is decoded.
+			From then on, the frame's slices between checkpoints can be
+			decoded in parallel, on the pool. */
+		struct smk_index_t {
+			unsigned long interval;
+			/* frames, checkpoints per frame, and all of them, frame by frame */
+			unsigned long frames;
+			unsigned long marks;
+			struct smk_mark_t * mark;
+			/* per frame: SMK_INDEX_*, and a hash of its video record */
+			unsigned char * state;
+			unsigned long * hash;
+			/* frames indexed, and frames decoded in slices */
+			unsigned long indexed;
+			unsigned long sliced;
+		} index;
+		/* hash of the trees, to match a sidecar index with */
+		unsigned long tree_hash;
+#ifdef SMK_HAVE_THREADS
+
+		/* reconstruction pool, if any */
+		struct smk_pool_t * pool;
+#endif
+	} video;
+
+	/* audio structure */
+	struct smk_audio_t {
+		/* set if track exists in file */
+		unsigned char exists;
+
+		/* enable/disable switch (per track) */
+		unsigned char enable;
 
 		/* Info */
 		unsigned char	channels;
@@ -588,16 +1432,30 @@ struct smk_t {
 		void * buffer;
 		unsigned long	buffer_size;
 	} audio[7];
-};
+#ifdef SMK_HAVE_THREADS
 
-union smk_read_t {
-	FILE * file;
-	unsigned char * ram;
+	/* audio decode thread, if turned on */
+	struct smk_audio_worker_t * audio_worker;
+	/* video entropy pipeline, if turned on */
+	struct smk_pipe_t * pipe;
+#endif
 };
 
 /* ************************************************************************* */
 /* SMACKER Functions */
 /* ************************************************************************* */
+/* 32-bit FNV-1a hash of a block of memory */
+static unsigned long smk_hash(const unsigned char * p, unsigned long size)
+{
+	unsigned long h = 2166136261UL;
+
+	for (; size > 0; size --)
+		h = ((h ^ *(p ++)) * 16777619UL) & 0xFFFFFFFFUL;
+
+	return h;
+}
+
+#ifndef SMK_HAVE_PREAD
 /* An fread wrapper: consumes N bytes, or returns -1
 	on failure (when size doesn't match expected) */
 static char smk_read_file(void * buf, const size_t size, FILE * fp)
@@ -613,534 +1471,3048 @@ static char smk_read_file(void * buf, const size_t size, FILE * fp)
 
 	return 0;
 }
+#endif
+
+/* Read N bytes at "offset" in fp, or return -1 on failure.
+	With pread, the stdio file position is left untouched. */
+static char smk_read_chunk(FILE * fp, const unsigned long offset, unsigned char * buf, size_t size)
+{
+#ifdef SMK_HAVE_PREAD
+	off_t pos = (off_t)offset;
+	ssize_t bytesRead;
+
+	while (size > 0) {
+		if ((bytesRead = pread(fileno(fp), buf, size, pos)) <= 0) {
+			if (bytesRead < 0 && errno == EINTR)
+				continue;
+
+			fprintf(stderr, "libsmacker::smk_read_chunk(fp,%lu,buf,%lu) - ERROR: Short read\n", offset, (unsigned long)size);
+
+			if (bytesRead < 0)
+				perror("\tReason");
+
+			return -1;
+		}
+
+		buf += bytesRead;
+		pos += bytesRead;
+		size -= (size_t)bytesRead;
+	}
+
+	return 0;
+#else
+
+	if (fseek(fp, offset, SEEK_SET)) {
+		fprintf(stderr, "libsmacker::smk_read_chunk(fp,%lu,buf,%lu) - ERROR: fseek failed.\n", offset, (unsigned long)size);
+		perror("\tError reported was");
+		return -1;
+	}
+
+	return smk_read_file(buf, size, fp);
+#endif
+}
+
+/* Built-in I/O for smk_open_file and smk_open_filepointer: a FILE *,
+	with offsets counted from where it was when handed over.
+	A FILE * that can't seek (a pipe, stdin) is read front to back
+	with fread, which is all SMK_MODE_MEMORY needs. */
+struct smk_io_file_t {
+	FILE * fp;
+	unsigned long base;
+	/* can't seek: read sequentially, and "pos" is how far it got */
+	unsigned char stream;
+	unsigned long pos;
+#ifdef SMK_HAVE_MMAP
+	/* the whole file, mapped read-only on first use of map() */
+	unsigned char * map;
+	size_t map_size;
+#endif
+};
 
-/* A memcpy wrapper: consumes N bytes, or returns -1
-	on failure (when size too low) */
-static char smk_read_memory(void * buf, const unsigned long size, unsigned char ** p, unsigned long * p_size)
+/* read_at on a stream: skip ahead to "offset" (never back), then read */
+static char smk_io_file_read_on(struct smk_io_file_t * io, const unsigned long offset, const unsigned long size, void * buf)
 {
-	if (size > *p_size) {
-		fprintf(stderr, "libsmacker::smk_read_memory(buf,%lu,p,%lu) - ERROR: Short read\n", (unsigned long)size, (unsigned long)*p_size);
+	unsigned char skip[4096];
+	size_t n;
+
+	if (offset < io->pos) {
+		fprintf(stderr, "libsmacker::smk_io_file_read_on(io,%lu,%lu,buf) - ERROR: can't seek back on a stream\n", offset, size);
 		return -1;
 	}
 
-	memcpy(buf, *p, size);
-	*p += size;
-	*p_size -= size;
+	while (io->pos < offset) {
+		n = (offset - io->pos < sizeof(skip) ? offset - io->pos : sizeof(skip));
+
+		if (fread(skip, 1, n, io->fp) != n)
+			goto error;
+
+		io->pos += n;
+	}
+
+	if (fread(buf, 1, size, io->fp) != size)
+		goto error;
+
+	io->pos += size;
 	return 0;
+error:
+	fprintf(stderr, "libsmacker::smk_io_file_read_on(io,%lu,%lu,buf) - ERROR: Short read\n", offset, size);
+	return -1;
 }
 
-/* Helper functions to do the reading, plus
-	byteswap from LE to host order */
-/* read n bytes from (source) into ret */
-#define smk_read(ret,n) \
-{ \
-	if (m) \
-	{ \
-		r = (smk_read_file(ret,n,fp.file)); \
-	} \
-	else \
-	{ \
-		r = (smk_read_memory(ret,n,&fp.ram,&size)); \
-	} \
-	if (r < 0) \
-	{ \
-		fprintf(stderr,"libsmacker::smk_read(...) - Errors encountered on read, bailing out (file: %s, line: %lu)\n", __FILE__, (unsigned long)__LINE__); \
-		goto error; \
-	} \
+static char smk_io_file_read_at(void * user, const unsigned long offset, const unsigned long size, void * buf)
+{
+	struct smk_io_file_t * io = user;
+
+	if (io->stream)
+		return smk_io_file_read_on(io, offset, size, buf);
+
+	return smk_read_chunk(io->fp, io->base + offset, buf, size);
 }
 
-/* Calls smk_read, but returns a ul */
-#define smk_read_ul(p) \
-{ \
-	smk_read(buf,4); \
-	p = ((unsigned long) buf[3] << 24) | \
-		((unsigned long) buf[2] << 16) | \
-		((unsigned long) buf[1] << 8) | \
-		((unsigned long) buf[0]); \
+static unsigned long smk_io_file_size(void * user)
+{
+	const struct smk_io_file_t * io = user;
+#ifdef SMK_HAVE_MMAP
+	struct stat st;
+#else
+	long end;
+#endif
+
+	/* a stream's size isn't known until it ends: as much as there may be */
+	if (io->stream)
+		return ~0UL;
+
+#ifdef SMK_HAVE_MMAP
+
+	if (fstat(fileno(io->fp), &st) || (unsigned long)st.st_size < io->base)
+		return 0;
+
+	return (unsigned long)st.st_size - io->base;
+#else
+
+	if (fseek(io->fp, 0, SEEK_END) || (end = ftell(io->fp)) < 0 || (unsigned long)end < io->base)
+		return 0;
+
+	return (unsigned long)end - io->base;
+#endif
 }
 
-/* PUBLIC FUNCTIONS */
-/* open an smk (from a generic Source) */
-static smk smk_open_generic(const unsigned char m, union smk_read_t fp, unsigned long size, const unsigned char process_mode)
+#ifdef SMK_HAVE_MMAP
+static const unsigned char * smk_io_file_map(void * user, const unsigned long offset, const unsigned long size)
 {
-	/* Smacker structure we intend to work on / return */
-	smk s;
-	/* Temporary variables */
-	long temp_l;
-	unsigned long temp_u;
-	/* r is used by macros above for return code */
-	char r;
-	unsigned char buf[4] = {'\0'};
-	/* video hufftrees are stored as a large chunk (bitstream)
-		these vars are used to load, then decode them */
-	unsigned char * hufftree_chunk = NULL;
-	unsigned long tree_size;
-	/* a bitstream struct */
-	struct smk_bit_t bs;
+	struct smk_io_file_t * io = user;
+	struct stat st;
+	void * m;
+
+	if (io->map == NULL) {
+		if (fstat(fileno(io->fp), &st)) {
+			perror("libsmacker::smk_io_file_map() - ERROR: could not get file size");
+			return NULL;
+		}
 
-	/** **/
-	/* safe malloc the structure */
-	if ((s = calloc(1, sizeof(struct smk_t))) == NULL) {
-		perror("libsmacker::smk_open_generic() - ERROR: failed to malloc() smk structure");
+		if ((m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fileno(io->fp), 0)) == MAP_FAILED) {
+			perror("libsmacker::smk_io_file_map() - ERROR: mmap() failed");
+			return NULL;
+		}
+
+		io->map = m;
+		io->map_size = (size_t)st.st_size;
+		/* playback reads front to back */
+		madvise(io->map, io->map_size, MADV_SEQUENTIAL);
+	}
+
+	if (io->base + offset > io->map_size || size > io->map_size - (io->base + offset)) {
+		fprintf(stderr, "libsmacker::smk_io_file_map(io,%lu,%lu) - ERROR: past end of file\n", offset, size);
 		return NULL;
 	}
 
-	/* Check for a valid signature */
-	smk_read(buf, 3);
+	return io->map + io->base + offset;
+}
+#endif
 
-	if (buf[0] != 'S' || buf[1] != 'M' || buf[2] != 'K') {
-		fprintf(stderr, "libsmacker::smk_open_generic - ERROR: invalid SMKn signature (got: %s)\n", buf);
-		goto error;
-	}
+static void smk_io_file_close(void * user)
+{
+	struct smk_io_file_t * io = user;
+#ifdef SMK_HAVE_MMAP
 
-	/* Read .smk file version */
-	smk_read(&s->video.v, 1);
+	if (io->map)
+		munmap(io->map, io->map_size);
 
-	if (s->video.v != '2' && s->video.v != '4') {
-		fprintf(stderr, "libsmacker::smk_open_generic - Warning: invalid SMK version %c (expected: 2 or 4)\n", s->video.v);
+#endif
+	fclose(io->fp);
+	free(io);
+}
 
-		/* take a guess */
-		if (s->video.v < '4')
-			s->video.v = '2';
-		else
-			s->video.v = '4';
+static const struct smk_io_t smk_io_file = {
+	smk_io_file_read_at,
+	smk_io_file_size,
+#ifdef SMK_HAVE_MMAP
+	smk_io_file_map,
+#else
+	NULL,
+#endif
+	smk_io_file_close
+};
 
-		fprintf(stderr, "\tProcessing will continue as type %c\n", s->video.v);
+/* Built-in I/O for smk_open_memory and smk_open_memory_borrowed */
+struct smk_io_memory_t {
+	const unsigned char * buffer;
+	unsigned long size;
+};
+
+static char smk_io_memory_read_at(void * user, const unsigned long offset, const unsigned long size, void * buf)
+{
+	const struct smk_io_memory_t * io = user;
+
+	if (offset > io->size || size > io->size - offset) {
+		fprintf(stderr, "libsmacker::smk_io_memory_read_at(io,%lu,%lu,buf) - ERROR: Short read\n", offset, size);
+		return -1;
 	}
 
-	/* width, height, total num frames */
-	smk_read_ul(s->video.w);
-	smk_read_ul(s->video.h);
-	smk_read_ul(s->f);
-	/* frames per second calculation */
-	smk_read_ul(temp_u);
-	temp_l = (int)temp_u;
+	memcpy(buf, io->buffer + offset, size);
+	return 0;
+}
 
-	if (temp_l > 0) {
-		/* millisec per frame */
-		s->usf = temp_l * 1000;
-	} else if (temp_l < 0) {
-		/* 10 microsec per frame */
-		s->usf = temp_l * -10;
+static unsigned long smk_io_memory_size(void * user)
+{
+	return ((const struct smk_io_memory_t *)user)->size;
+}
+
+static const unsigned char * smk_io_memory_map(void * user, const unsigned long offset, const unsigned long size)
+{
+	const struct smk_io_memory_t * io = user;
+
+	if (offset > io->size || size > io->size - offset) {
+		fprintf(stderr, "libsmacker::smk_io_memory_map(io,%lu,%lu) - ERROR: past end of buffer\n", offset, size);
+		return NULL;
+	}
+
+	return io->buffer + offset;
+}
+
+static void smk_io_memory_close(void * user)
+{
+	free(user);
+}
+
+static const struct smk_io_t smk_io_memory = {
+	smk_io_memory_read_at,
+	smk_io_memory_size,
+	smk_io_memory_map,
+	smk_io_memory_close
+};
+
+#ifdef SMK_HAVE_IO_URING
+/* File descriptor s reads from, if it's a plain file (-1 if not) */
+static int smk_io_fd(const smk s)
+{
+	if (s->source.io.read_at != smk_io_file_read_at)
+		return -1;
+
+	return fileno(((const struct smk_io_file_t *)s->source.user)->fp);
+}
+#endif
+
+#ifdef SMK_HAVE_THREADS
+/* Disk-mode read-ahead (smk_set_readahead).
+	An I/O thread keeps the chunks after the one being played read into
+	a ring buffer, up to "window" chunks and "budget" bytes. Runs of
+	chunks that sit back to back in the file are read in one go.
+	smk_render decodes straight out of the ring: the chunk it was
+	handed is only given back on its next call. */
+/* largest single read the I/O thread makes */
+#define SMK_READAHEAD_BATCH	0x100000
+
+/* queue entry states */
+#define SMK_READAHEAD_READING	0
+#define SMK_READAHEAD_READY	1
+#define SMK_READAHEAD_FAILED	2
+
+struct smk_readahead_t {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	/* "ready": a read finished; "room": space was freed, or the thread
+		has new orders */
+	pthread_cond_t ready, room;
+
+	/* what to read from */
+	struct smk_io_t io;
+	void * user;
+	const unsigned long * chunk_offset;
+	const unsigned long * chunk_size;
+	unsigned long frames;
+	unsigned char ring_frame;
+
+	/* the ring buffer */
+	unsigned char * buffer;
+	size_t budget;
+	/* end of the last chunk placed in it */
+	size_t wr;
+
+	/* chunks read or being read, in play order: "count" of them from "head" */
+	struct smk_readahead_entry_t {
+		unsigned long frame;
+		size_t pos;
+		unsigned char state;
+	} * queue;
+	unsigned long window;
+	unsigned long head;
+	unsigned long count;
+
+	/* next frame to read (frames: none left) */
+	unsigned long next;
+	/* bumped on every retarget: reads started before then are dropped */
+	unsigned long generation;
+	/* the head entry was handed to smk_render */
+	unsigned char held;
+	unsigned char quit;
+
+	/* chunks that were ready when asked for, and ones that weren't */
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/* The frame played after f: wraps to 1 if the file loops */
+static unsigned long smk_readahead_after(const struct smk_readahead_t * ra, const unsigned long f)
+{
+	if (f + 1 < ra->frames)
+		return f + 1;
+
+	return (ra->ring_frame ? 1 : ra->frames);
+}
+
+/* Is [pos, pos + size) inside the buffer, and clear of every queued chunk? */
+static char smk_readahead_fits(const struct smk_readahead_t * ra, const size_t pos, const size_t size)
+{
+	unsigned long i;
+	const struct smk_readahead_entry_t * e;
+
+	if (size > ra->budget - pos)
+		return 0;
+
+	for (i = 0; i < ra->count; i ++) {
+		e = &ra->queue[(ra->head + i) % ra->window];
+
+		if (pos < e->pos + ra->chunk_size[e->frame] && e->pos < pos + size)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Drop everything queued, and start reading again from frame f.
+	Call with the lock held. */
+static void smk_readahead_retarget(struct smk_readahead_t * ra, const unsigned long f)
+{
+	ra->generation ++;
+	ra->head = 0;
+	ra->count = 0;
+	ra->held = 0;
+	ra->wr = 0;
+	ra->next = f;
+	pthread_cond_signal(&ra->room);
+}
+
+/* The I/O thread */
+static void * smk_readahead_thread(void * arg)
+{
+	struct smk_readahead_t * ra = arg;
+	unsigned long f, prev, k, i, slot, generation;
+	size_t pos, size;
+	char r;
+
+	pthread_mutex_lock(&ra->lock);
+
+	while (! ra->quit) {
+		/* gather a run of chunks, back to back in the file, that fits in the ring */
+		f = ra->next;
+		prev = f;
+		pos = 0;
+		size = 0;
+
+		for (k = 0; f < ra->frames && ra->count + k < ra->window; k ++) {
+			if (k == 0) {
+				/* at the write position, or wrapped back to the start */
+				pos = (smk_readahead_fits(ra, ra->wr, ra->chunk_size[f]) ? ra->wr : 0);
+
+				if (! smk_readahead_fits(ra, pos, ra->chunk_size[f]))
+					break;
+			} else if (ra->chunk_offset[f] != ra->chunk_offset[prev] + ra->chunk_size[prev] ||
+				size + ra->chunk_size[f] > SMK_READAHEAD_BATCH ||
+				! smk_readahead_fits(ra, pos, size + ra->chunk_size[f]))
+				break;
+
+			size += ra->chunk_size[f];
+			prev = f;
+			f = smk_readahead_after(ra, f);
+		}
+
+		if (k == 0) {
+			/* window full, out of room, or at the end: wait */
+			pthread_cond_wait(&ra->room, &ra->lock);
+			continue;
+		}
+
+		/* queue the run, then read it without the lock */
+		slot = (ra->head + ra->count) % ra->window;
+		f = ra->next;
+
+		for (i = 0; i < k; i ++) {
+			ra->queue[(slot + i) % ra->window].frame = f;
+			ra->queue[(slot + i) % ra->window].pos = pos;
+			ra->queue[(slot + i) % ra->window].state = SMK_READAHEAD_READING;
+			pos += ra->chunk_size[f];
+			f = smk_readahead_after(ra, f);
+		}
+
+		pos -= size;
+		ra->count += k;
+		ra->wr = pos + size;
+		ra->next = f;
+		generation = ra->generation;
+		f = ra->queue[slot].frame;
+		pthread_mutex_unlock(&ra->lock);
+		r = ra->io.read_at(ra->user, ra->chunk_offset[f], size, ra->buffer + pos);
+		pthread_mutex_lock(&ra->lock);
+
+		/* (if smk_render retargeted meanwhile, these entries are gone) */
+		if (generation == ra->generation) {
+			for (i = 0; i < k; i ++)
+				ra->queue[(slot + i) % ra->window].state = (r < 0 ? SMK_READAHEAD_FAILED : SMK_READAHEAD_READY);
+
+			pthread_cond_broadcast(&ra->ready);
+		}
+	}
+
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+/* Chunk for frame f, out of the ring: NULL if it wasn't read ahead
+	(after a seek, say), in which case reading restarts after f. */
+static unsigned char * smk_readahead_fetch(struct smk_readahead_t * ra, const unsigned long f)
+{
+	unsigned char * p = NULL;
+	struct smk_readahead_entry_t * e;
+
+	pthread_mutex_lock(&ra->lock);
+
+	/* give back the chunk handed out last time */
+	if (ra->held) {
+		ra->head = (ra->head + 1) % ra->window;
+		ra->count --;
+		ra->held = 0;
+		pthread_cond_signal(&ra->room);
+	}
+
+	e = &ra->queue[ra->head];
+
+	/* a chunk read but never asked for (the frame shown when read-ahead
+		started) is skipped */
+	if (ra->count > 0 && e->frame != f && e->state != SMK_READAHEAD_READING &&
+		smk_readahead_after(ra, e->frame) == f) {
+		ra->head = (ra->head + 1) % ra->window;
+		ra->count --;
+		pthread_cond_signal(&ra->room);
+		e = &ra->queue[ra->head];
+	}
+
+	if (ra->count > 0 && e->frame == f) {
+		if (e->state == SMK_READAHEAD_READY)
+			ra->hits ++;
+		else {
+			ra->misses ++;
+
+			while (e->state == SMK_READAHEAD_READING)
+				pthread_cond_wait(&ra->ready, &ra->lock);
+		}
+
+		if (e->state == SMK_READAHEAD_READY) {
+			ra->held = 1;
+			p = ra->buffer + e->pos;
+		} else
+			smk_readahead_retarget(ra, smk_readahead_after(ra, f));
 	} else {
-		/* defaults to 10 usf (= 100000 microseconds) */
-		s->usf = 100000;
+		ra->misses ++;
+		smk_readahead_retarget(ra, smk_readahead_after(ra, f));
+	}
+
+	pthread_mutex_unlock(&ra->lock);
+	return p;
+}
+
+/* Set up read-ahead for a disk-mode smk, and start the I/O thread */
+static struct smk_readahead_t * smk_readahead_start(smk s, const unsigned long window, size_t budget)
+{
+	struct smk_readahead_t * ra = NULL;
+	const size_t largest = s->source.file.buffer_size;
+
+	/* default: room for "window" of the largest chunk; never less than one */
+	if (budget == 0)
+		budget = largest * window;
+	else if (budget < largest)
+		budget = largest;
+
+	smk_malloc(ra, sizeof(struct smk_readahead_t));
+	smk_malloc(ra->queue, window * sizeof(struct smk_readahead_entry_t));
+
+	if ((ra->buffer = malloc(budget)) == NULL) {
+		perror("libsmacker::smk_readahead_start() - ERROR: failed to malloc() buffer");
+		smk_free(ra->queue);
+		smk_free(ra);
+		return NULL;
+	}
+
+	ra->io = s->source.io;
+	ra->user = s->source.user;
+	ra->chunk_offset = s->source.file.chunk_offset;
+	ra->chunk_size = s->chunk_size;
+	ra->frames = s->f + s->ring_frame;
+	ra->ring_frame = s->ring_frame;
+	ra->budget = budget;
+	ra->window = window;
+	ra->next = s->cur_frame;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->ready, NULL);
+	pthread_cond_init(&ra->room, NULL);
+
+	if (pthread_create(&ra->thread, NULL, smk_readahead_thread, ra)) {
+		fputs("libsmacker::smk_readahead_start() - ERROR: failed to start I/O thread\n", stderr);
+		pthread_cond_destroy(&ra->room);
+		pthread_cond_destroy(&ra->ready);
+		pthread_mutex_destroy(&ra->lock);
+		free(ra->buffer);
+		smk_free(ra->queue);
+		smk_free(ra);
+		return NULL;
+	}
+
+	return ra;
+}
+
+/* Stop the I/O thread and free everything */
+static void smk_readahead_stop(struct smk_readahead_t * ra)
+{
+	pthread_mutex_lock(&ra->lock);
+	ra->quit = 1;
+	pthread_cond_signal(&ra->room);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_join(ra->thread, NULL);
+	pthread_cond_destroy(&ra->room);
+	pthread_cond_destroy(&ra->ready);
+	pthread_mutex_destroy(&ra->lock);
+	smk_free(ra->queue);
+	free(ra->buffer);
+	smk_free(ra);
+}
+
+/* Progressive in-memory load (SMK_MODE_PROGRESSIVE).
+	smk_open_generic hands back the smk with its chunk arena still
+	empty, and a loader thread fills it front to back: the first chunk
+	on its own, so the first frame is ready as soon as it can be, then
+	the rest in large reads. smk_render waits for the chunk it needs. */
+/* largest single read the loader makes */
+#define SMK_LOAD_BATCH	0x100000
+
+struct smk_load_t {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	/* signalled after every read */
+	pthread_cond_t ready;
+
+	/* what to read from: "total" bytes at "offset", into "arena" */
+	struct smk_io_t io;
+	void * user;
+	unsigned long offset;
+	unsigned long total;
+	unsigned char * arena;
+	/* size of the first chunk */
+	unsigned long first;
+
+	/* bytes in so far */
+	unsigned long done;
+	unsigned char failed;
+	unsigned char quit;
+};
+
+/* The loader thread */
+static void * smk_load_thread(void * arg)
+{
+	struct smk_load_t * ld = arg;
+	unsigned long done, n;
+	char r;
+
+	pthread_mutex_lock(&ld->lock);
+
+	while (! ld->quit && ! ld->failed && ld->done < ld->total) {
+		done = ld->done;
+		n = ld->total - done;
+
+		if (done == 0 && ld->first)
+			n = ld->first;
+		else if (n > SMK_LOAD_BATCH)
+			n = SMK_LOAD_BATCH;
+
+		/* (only this thread writes past "done": read without the lock) */
+		pthread_mutex_unlock(&ld->lock);
+		r = ld->io.read_at(ld->user, ld->offset + done, n, ld->arena + done);
+		pthread_mutex_lock(&ld->lock);
+
+		if (r < 0)
+			ld->failed = 1;
+		else
+			ld->done += n;
+
+		pthread_cond_broadcast(&ld->ready);
+	}
+
+	pthread_mutex_unlock(&ld->lock);
+	return NULL;
+}
+
+/* Wait for the first "end" bytes of the arena.
+	Returns -1 if they won't arrive, 1 if everything has, 0 otherwise. */
+static char smk_load_wait(struct smk_load_t * ld, const unsigned long end)
+{
+	char r;
+
+	pthread_mutex_lock(&ld->lock);
+
+	while (ld->done < end && ! ld->failed)
+		pthread_cond_wait(&ld->ready, &ld->lock);
+
+	r = (ld->done < end ? -1 : ld->done == ld->total);
+	pthread_mutex_unlock(&ld->lock);
+	return r;
+}
+
+/* Start loading "total" bytes of chunks at "offset" into the arena */
+static struct smk_load_t * smk_load_start(smk s, const unsigned long offset, const unsigned long total)
+{
+	struct smk_load_t * ld = NULL;
+
+	smk_malloc(ld, sizeof(struct smk_load_t));
+	ld->io = s->source.io;
+	ld->user = s->source.user;
+	ld->offset = offset;
+	ld->total = total;
+	ld->arena = s->source.arena;
+	ld->first = s->chunk_size[0];
+	pthread_mutex_init(&ld->lock, NULL);
+	pthread_cond_init(&ld->ready, NULL);
+
+	if (pthread_create(&ld->thread, NULL, smk_load_thread, ld)) {
+		fputs("libsmacker::smk_load_start() - ERROR: failed to start loader thread\n", stderr);
+		pthread_cond_destroy(&ld->ready);
+		pthread_mutex_destroy(&ld->lock);
+		smk_free(ld);
+		return NULL;
+	}
+
+	return ld;
+}
+
+/* Stop the loader (after the read it is on) and free it */
+static void smk_load_stop(struct smk_load_t * ld)
+{
+	pthread_mutex_lock(&ld->lock);
+	ld->quit = 1;
+	pthread_mutex_unlock(&ld->lock);
+	pthread_join(ld->thread, NULL);
+	pthread_cond_destroy(&ld->ready);
+	pthread_mutex_destroy(&ld->lock);
+	smk_free(ld);
+}
+
+/* Audio worker (smk_set_audio_thread).
+	A thread of the smk's own decodes a frame's audio tracks while
+	smk_render decodes the video on the calling thread; smk_render
+	waits for it before returning. */
+static char smk_render_audio(struct smk_audio_t * s, unsigned char * p, unsigned long size);
+
+struct smk_audio_worker_t {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	/* "go": there are tracks to decode, or it's time to quit;
+		"done": they are decoded */
+	pthread_cond_t go, done;
+
+	/* the smk's tracks, and each one's data for this frame */
+	struct smk_audio_t * audio;
+	unsigned char * p[7];
+	unsigned long size[7];
+	/* tracks to decode: set by smk_render, cleared once decoded */
+	unsigned char mask;
+	unsigned char quit;
+};
+
+/* The audio thread */
+static void * smk_audio_worker_thread(void * arg)
+{
+	struct smk_audio_worker_t * aw = arg;
+	unsigned char track;
+
+	pthread_mutex_lock(&aw->lock);
+
+	for (;;) {
+		while (! aw->mask && ! aw->quit)
+			pthread_cond_wait(&aw->go, &aw->lock);
+
+		if (aw->quit)
+			break;
+
+		/* (smk_render leaves the tracks alone until "mask" is clear) */
+		pthread_mutex_unlock(&aw->lock);
+
+		for (track = 0; track < 7; track ++) {
+			if (aw->mask & (1 << track))
+				smk_render_audio(&aw->audio[track], aw->p[track], aw->size[track]);
+		}
+
+		pthread_mutex_lock(&aw->lock);
+		aw->mask = 0;
+		pthread_cond_signal(&aw->done);
+	}
+
+	pthread_mutex_unlock(&aw->lock);
+	return NULL;
+}
+
+/* Hand the tracks in "mask" to the audio thread */
+static void smk_audio_worker_post(struct smk_audio_worker_t * aw, const unsigned char mask, unsigned char * p[7], const unsigned long size[7])
+{
+	pthread_mutex_lock(&aw->lock);
+	memcpy(aw->p, p, sizeof(aw->p));
+	memcpy(aw->size, size, sizeof(aw->size));
+	aw->mask = mask;
+	pthread_cond_signal(&aw->go);
+	pthread_mutex_unlock(&aw->lock);
+}
+
+/* Wait for the audio thread to finish the tracks handed to it */
+static void smk_audio_worker_wait(struct smk_audio_worker_t * aw)
+{
+	pthread_mutex_lock(&aw->lock);
+
+	while (aw->mask)
+		pthread_cond_wait(&aw->done, &aw->lock);
+
+	pthread_mutex_unlock(&aw->lock);
+}
+
+/* Start an audio thread for an smk */
+static struct smk_audio_worker_t * smk_audio_worker_start(smk s)
+{
+	struct smk_audio_worker_t * aw = NULL;
+
+	smk_malloc(aw, sizeof(struct smk_audio_worker_t));
+	aw->audio = s->audio;
+	pthread_mutex_init(&aw->lock, NULL);
+	pthread_cond_init(&aw->go, NULL);
+	pthread_cond_init(&aw->done, NULL);
+
+	if (pthread_create(&aw->thread, NULL, smk_audio_worker_thread, aw)) {
+		fputs("libsmacker::smk_audio_worker_start() - ERROR: failed to start audio thread\n", stderr);
+		pthread_cond_destroy(&aw->done);
+		pthread_cond_destroy(&aw->go);
+		pthread_mutex_destroy(&aw->lock);
+		smk_free(aw);
+		return NULL;
+	}
+
+	return aw;
+}
+
+/* Stop the audio thread and free it */
+static void smk_audio_worker_stop(struct smk_audio_worker_t * aw)
+{
+	pthread_mutex_lock(&aw->lock);
+	aw->quit = 1;
+	pthread_cond_signal(&aw->go);
+	pthread_mutex_unlock(&aw->lock);
+	pthread_join(aw->thread, NULL);
+	pthread_cond_destroy(&aw->done);
+	pthread_cond_destroy(&aw->go);
+	pthread_mutex_destroy(&aw->lock);
+	smk_free(aw);
+}
+
+/* Video pipeline (smk_set_pipeline).
+	Video decodes in two stages: entropy (the bitstream, through the
+	trees, into block commands) and reconstruction (the commands applied
+	to the frame). Only reconstruction needs the previous frame, so while
+	smk_render reconstructs frame N, a thread of the smk's own entropy-
+	decodes frame N+1 into a second command buffer. */
+static void smk_video_entropy(struct smk_video_t * s, struct smk_cmds_t * c, struct smk_pool_t * pool, unsigned long f, const unsigned char * p, unsigned long size);
+
+/* pipeline states */
+#define SMK_PIPE_IDLE	0
+#define SMK_PIPE_BUSY	1
+#define SMK_PIPE_READY	2
+
+struct smk_pipe_t {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	/* "go": there is a frame to decode, or it's time to quit;
+		"done": it is decoded */
+	pthread_cond_t go, done;
+
+	/* the trees (and index) to decode with: nothing else in it is touched */
+	struct smk_video_t * video;
+	/* the pool the smk had when the frame was handed over (not "video"'s,
+		which may change meanwhile) */
+	struct smk_pool_t * pool;
+	/* the frame being decoded or decoded, its video record, and the commands */
+	unsigned long frame;
+	const unsigned char * p;
+	unsigned long size;
+	struct smk_cmds_t cmds;
+	unsigned char state;
+	unsigned char quit;
+};
+
+/* The pipeline thread */
+static void * smk_pipe_thread(void * arg)
+{
+	struct smk_pipe_t * pp = arg;
+
+	pthread_mutex_lock(&pp->lock);
+
+	for (;;) {
+		while (pp->state != SMK_PIPE_BUSY && ! pp->quit)
+			pthread_cond_wait(&pp->go, &pp->lock);
+
+		if (pp->quit)
+			break;
+
+		/* (smk_render leaves the trees and "cmds" alone while busy) */
+		pthread_mutex_unlock(&pp->lock);
+		smk_video_entropy(pp->video, &pp->cmds, pp->pool, pp->frame, pp->p, pp->size);
+		pthread_mutex_lock(&pp->lock);
+		pp->state = SMK_PIPE_READY;
+		pthread_cond_signal(&pp->done);
+	}
+
+	pthread_mutex_unlock(&pp->lock);
+	return NULL;
+}
+
+/* Wait for the pipeline to be idle. Returns 1 if it had decoded frame f
+	(swapped into the smk's "cmds", then), 0 if not. */
+static char smk_pipe_take(struct smk_pipe_t * pp, struct smk_cmds_t * cmds, const unsigned long f)
+{
+	struct smk_cmds_t temp;
+	char r;
+
+	pthread_mutex_lock(&pp->lock);
+
+	while (pp->state == SMK_PIPE_BUSY)
+		pthread_cond_wait(&pp->done, &pp->lock);
+
+	r = (pp->state == SMK_PIPE_READY && pp->frame == f);
+
+	if (r) {
+		temp = *cmds;
+		*cmds = pp->cmds;
+		pp->cmds = temp;
+	}
+
+	pp->state = SMK_PIPE_IDLE;
+	pthread_mutex_unlock(&pp->lock);
+	return r;
+}
+
+/* Wait for the pipeline to finish the frame it is on, if any
+	(leaving it decoded, to be taken) */
+static void smk_pipe_wait(struct smk_pipe_t * pp)
+{
+	pthread_mutex_lock(&pp->lock);
+
+	while (pp->state == SMK_PIPE_BUSY)
+		pthread_cond_wait(&pp->done, &pp->lock);
+
+	pthread_mutex_unlock(&pp->lock);
+}
+
+/* Start decoding frame f's video record (the pipeline is idle) */
+static void smk_pipe_post(struct smk_pipe_t * pp, struct smk_pool_t * pool, const unsigned long f, const unsigned char * p, const unsigned long size)
+{
+	pthread_mutex_lock(&pp->lock);
+	pp->pool = pool;
+	pp->frame = f;
+	pp->p = p;
+	pp->size = size;
+	pp->state = SMK_PIPE_BUSY;
+	pthread_cond_signal(&pp->go);
+	pthread_mutex_unlock(&pp->lock);
+}
+
+/* Start a pipeline thread for an smk */
+static struct smk_pipe_t * smk_pipe_start(smk s)
+{
+	struct smk_pipe_t * pp = NULL;
+
+	smk_malloc(pp, sizeof(struct smk_pipe_t));
+	smk_malloc(pp->cmds.cmd, 10 * sizeof(unsigned short) * ((s->video.w + 3) >> 2) * ((s->video.h + 3) >> 2));
+	smk_malloc(pp->cmds.row, sizeof(unsigned long) * ((s->video.h + 3) >> 2));
+	pp->video = &s->video;
+	pthread_mutex_init(&pp->lock, NULL);
+	pthread_cond_init(&pp->go, NULL);
+	pthread_cond_init(&pp->done, NULL);
+
+	if (pthread_create(&pp->thread, NULL, smk_pipe_thread, pp)) {
+		fputs("libsmacker::smk_pipe_start() - ERROR: failed to start pipeline thread\n", stderr);
+		pthread_cond_destroy(&pp->done);
+		pthread_cond_destroy(&pp->go);
+		pthread_mutex_destroy(&pp->lock);
+		smk_free(pp->cmds.row);
+		smk_free(pp->cmds.cmd);
+		smk_free(pp);
+		return NULL;
+	}
+
+	return pp;
+}
+
+/* Stop the pipeline thread (after the frame it is on) and free it */
+static void smk_pipe_stop(struct smk_pipe_t * pp)
+{
+	pthread_mutex_lock(&pp->lock);
+	pp->quit = 1;
+	pthread_cond_signal(&pp->go);
+	pthread_mutex_unlock(&pp->lock);
+	pthread_join(pp->thread, NULL);
+	pthread_cond_destroy(&pp->done);
+	pthread_cond_destroy(&pp->go);
+	pthread_mutex_destroy(&pp->lock);
+	smk_free(pp->cmds.row);
+	smk_free(pp->cmds.cmd);
+	smk_free(pp);
+}
+
+/* Reconstruction pool (smk_pool_*).
+	smk hand the reconstruction stage of each frame to a pool they share,
+	split into bands of block rows (which are independent: commands never
+	cross rows). Pool threads take the next band of whichever frame is
+	first in line, and a rendering thread works on its own frame's bands
+	too, until all of them are handed out.
+	Frames with an entropy index also have their entropy stage done
+	here, a slice between checkpoints to a band. */
+static void smk_video_rows(struct smk_video_t * s, const struct smk_cmds_t * c, unsigned long r0, unsigned long r1, unsigned char convert);
+static char smk_video_slice(const struct smk_video_t * s, struct smk_cmds_t * c, const unsigned char * p, unsigned long size, unsigned long r0, unsigned long r1, const struct smk_mark_t * from, struct smk_mark_t * mark, unsigned long * len, unsigned long * rows);
+
+/* about this many bands per thread (pool threads and the renderer):
+	enough to even out bands that take longer than others */
+#define SMK_POOL_BANDS	4
+
+/* A frame being worked on: lives on the submitting thread's stack */
+struct smk_pool_job_t {
+	/* do block rows r0 to r1: returns -1 if that failed */
+	char (* work)(struct smk_pool_job_t * job, unsigned long r0, unsigned long r1);
+	struct smk_video_t * video;
+	struct smk_cmds_t * cmds;
+	/* reconstruction: convert every pixel row afterwards */
+	unsigned char convert;
+	/* entropy: the video record, the frame's checkpoints,
+		and the end of the last slice's commands */
+	const unsigned char * p;
+	unsigned long size;
+	const struct smk_mark_t * mark;
+	unsigned long len;
+	/* block rows, and rows per band */
+	unsigned long rows;
+	unsigned long band;
+	/* bands: handed out so far, finished, and in all */
+	unsigned long next;
+	unsigned long done;
+	unsigned long bands;
+	/* a band failed */
+	unsigned char failed;
+	/* next in line */
+	struct smk_pool_job_t * link;
+};
+
+struct smk_pool_t {
+	pthread_mutex_t lock;
+	/* "work": a frame was queued, or it's time to quit;
+		"done": a frame's last band is finished */
+	pthread_cond_t work, done;
+	pthread_t * thread;
+	unsigned int threads;
+	/* frames with bands not handed out yet, oldest first */
+	struct smk_pool_job_t * head;
+	struct smk_pool_job_t * tail;
+	unsigned char quit;
+};
+
+/* Hand out the next band of a queued frame (dropping it from the queue
+	with the last one). Call with the lock held. */
+static unsigned long smk_pool_take(struct smk_pool_t * pool, struct smk_pool_job_t * job)
+{
+	struct smk_pool_job_t ** j;
+	const unsigned long b = job->next ++;
+
+	if (job->next == job->bands) {
+		for (j = &pool->head; *j != job; j = &(*j)->link);
+
+		*j = job->link;
+
+		if (pool->tail == job) {
+			pool->tail = NULL;
+
+			for (job = pool->head; job; job = job->link)
+				pool->tail = job;
+		}
+	}
+
+	return b;
+}
+
+/* Do band b of a frame, without the lock, and count it done */
+static void smk_pool_band(struct smk_pool_t * pool, struct smk_pool_job_t * job, const unsigned long b)
+{
+	const unsigned long r0 = b * job->band;
+	const unsigned long r1 = (r0 + job->band < job->rows ? r0 + job->band : job->rows);
+	char r;
+
+	pthread_mutex_unlock(&pool->lock);
+	r = job->work(job, r0, r1);
+	pthread_mutex_lock(&pool->lock);
+
+	if (r < 0)
+		job->failed = 1;
+
+	if (++ job->done == job->bands)
+		pthread_cond_broadcast(&pool->done);
+}
+
+/* A pool thread */
+static void * smk_pool_thread(void * arg)
+{
+	struct smk_pool_t * pool = arg;
+	struct smk_pool_job_t * job;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;) {
+		while (pool->head == NULL && ! pool->quit)
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		if (pool->quit)
+			break;
+
+		job = pool->head;
+		smk_pool_band(pool, job, smk_pool_take(pool, job));
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Queue a job (work, its data, rows and band filled in), help out,
+	and return when every band is done: -1 if any failed */
+static char smk_pool_run(struct smk_pool_t * pool, struct smk_pool_job_t * job)
+{
+	job->next = 0;
+	job->done = 0;
+	job->bands = (job->rows + job->band - 1) / job->band;
+	job->failed = 0;
+	job->link = NULL;
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->tail)
+		pool->tail->link = job;
+	else
+		pool->head = job;
+
+	pool->tail = job;
+	pthread_cond_broadcast(&pool->work);
+
+	while (job->next < job->bands)
+		smk_pool_band(pool, job, smk_pool_take(pool, job));
+
+	while (job->done < job->bands)
+		pthread_cond_wait(&pool->done, &pool->lock);
+
+	pthread_mutex_unlock(&pool->lock);
+	return (job->failed ? -1 : 0);
+}
+
+/* Pool work: reconstruct block rows */
+static char smk_pool_rows(struct smk_pool_job_t * job, const unsigned long r0, const unsigned long r1)
+{
+	smk_video_rows(job->video, job->cmds, r0, r1, job->convert);
+	return 0;
+}
+
+/* Pool work: entropy-decode the slice of a frame from checkpoint to checkpoint */
+static char smk_pool_slice(struct smk_pool_job_t * job, const unsigned long r0, const unsigned long r1)
+{
+	unsigned long len, rows;
+
+	if (smk_video_slice(job->video, job->cmds, job->p, job->size, r0, r1,
+			(r0 ? &job->mark[r0 / job->band - 1] : NULL), NULL, &len, &rows) < 0)
+		return -1;
+
+	/* (only one slice ends the frame) */
+	if (r1 == job->rows)
+		job->len = len;
+
+	return 0;
+}
+#endif
+
+/* Chunk fetch queue (smk_fetch_*).
+	Reads chunks for many disk-mode smk through one io_uring. Each read
+	lands in its smk's own fetch buffer, and smk_render decodes from
+	there when it is for the frame being rendered. Without io_uring
+	(or if a read comes back short), reads are done with smk_read_chunk. */
+/* fetch_state values */
+#define SMK_FETCH_NONE	0
+#define SMK_FETCH_READING	1
+#define SMK_FETCH_READY	2
+#define SMK_FETCH_FAILED	3
+
+struct smk_fetch_t {
+	/* room for this many reads, in flight or waiting to be collected */
+	unsigned int depth;
+	unsigned int in_flight;
+
+	/* smk whose reads finished, not yet returned by smk_fetch_wait */
+	smk * done;
+	unsigned int done_head;
+	unsigned int done_count;
+
+#ifdef SMK_HAVE_IO_URING
+	/* the ring (fd -1: not available, read on submit) */
+	int fd;
+	void * sq_ring, * cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe * sqes;
+	size_t sqes_size;
+	unsigned int * sq_tail, * sq_mask, * sq_array;
+	unsigned int * cq_head, * cq_tail, * cq_mask;
+	struct io_uring_cqe * cqes;
+#endif
+};
+
+/* A read for s is over, with "result" bytes read (or an error):
+	finish it off if need be, and put s on the done list */
+static void smk_fetch_finish(struct smk_fetch_t * q, smk s, long result)
+{
+	const unsigned long f = s->source.file.fetch_frame;
+
+	if (result != (long)s->chunk_size[f])
+		result = s->source.io.read_at(s->source.user, s->source.file.chunk_offset[f], s->chunk_size[f], s->source.file.fetch_buffer);
+
+	s->source.file.fetch_state = (result < 0 ? SMK_FETCH_FAILED : SMK_FETCH_READY);
+	q->done[(q->done_head + q->done_count) % q->depth] = s;
+	q->done_count ++;
+}
+
+#ifdef SMK_HAVE_IO_URING
+static int smk_io_uring_enter(const int fd, const unsigned int submit, const unsigned int wait)
+{
+	int r;
+
+	do
+		r = (int)syscall(__NR_io_uring_enter, fd, submit, wait, (wait ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+	while (r < 0 && errno == EINTR);
+
+	return r;
+}
+
+/* Tear down the ring */
+static void smk_fetch_unring(struct smk_fetch_t * q)
+{
+	if (q->sqes)
+		munmap(q->sqes, q->sqes_size);
+
+	if (q->cq_ring && q->cq_ring != q->sq_ring)
+		munmap(q->cq_ring, q->cq_ring_size);
+
+	if (q->sq_ring)
+		munmap(q->sq_ring, q->sq_ring_size);
+
+	if (q->fd >= 0)
+		close(q->fd);
+
+	q->fd = -1;
+	q->sq_ring = q->cq_ring = NULL;
+	q->sqes = NULL;
+}
+
+/* Set up the ring, or return -1 if the kernel won't */
+static char smk_fetch_ring(struct smk_fetch_t * q)
+{
+	struct io_uring_params p;
+	void * m;
+	memset(&p, 0, sizeof(p));
+
+	if ((q->fd = (int)syscall(__NR_io_uring_setup, q->depth, &p)) < 0)
+		return -1;
+
+	q->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	q->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* newer kernels map both rings at once */
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && q->cq_ring_size > q->sq_ring_size)
+		q->sq_ring_size = q->cq_ring_size;
+
+	if ((m = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+		goto error;
+
+	q->sq_ring = m;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		q->cq_ring = q->sq_ring;
+	else {
+		if ((m = mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+			goto error;
+
+		q->cq_ring = m;
+	}
+
+	q->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if ((m = mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES)) == MAP_FAILED)
+		goto error;
+
+	q->sqes = m;
+	q->sq_tail = (unsigned int *)((char *)q->sq_ring + p.sq_off.tail);
+	q->sq_mask = (unsigned int *)((char *)q->sq_ring + p.sq_off.ring_mask);
+	q->sq_array = (unsigned int *)((char *)q->sq_ring + p.sq_off.array);
+	q->cq_head = (unsigned int *)((char *)q->cq_ring + p.cq_off.head);
+	q->cq_tail = (unsigned int *)((char *)q->cq_ring + p.cq_off.tail);
+	q->cq_mask = (unsigned int *)((char *)q->cq_ring + p.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe *)((char *)q->cq_ring + p.cq_off.cqes);
+	return 0;
+error:
+	smk_fetch_unring(q);
+	return -1;
+}
+
+/* Queue a read of s's fetch frame on the ring: -1 if it wouldn't take it */
+static char smk_fetch_ring_submit(struct smk_fetch_t * q, smk s)
+{
+	const unsigned long f = s->source.file.fetch_frame;
+	const unsigned int tail = *q->sq_tail;
+	const unsigned int i = tail & *q->sq_mask;
+	struct io_uring_sqe * sqe = &q->sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = smk_io_fd(s);
+	sqe->off = ((const struct smk_io_file_t *)s->source.user)->base + s->source.file.chunk_offset[f];
+	sqe->addr = (unsigned long)s->source.file.fetch_buffer;
+	sqe->len = s->chunk_size[f];
+	sqe->user_data = (unsigned long)s;
+	q->sq_array[i] = i;
+	__atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (smk_io_uring_enter(q->fd, 1, 0) < 1) {
+		/* not taken: withdraw it */
+		__atomic_store_n(q->sq_tail, tail, __ATOMIC_RELEASE);
+		return -1;
+	}
+
+	q->in_flight ++;
+	return 0;
+}
+
+/* Collect one finished read from the ring, waiting for it if need be */
+static char smk_fetch_reap(struct smk_fetch_t * q)
+{
+	const unsigned int head = *q->cq_head;
+	const struct io_uring_cqe * cqe;
+	smk s;
+	long result;
+
+	while (head == __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (smk_io_uring_enter(q->fd, 0, 1) < 0) {
+			perror("libsmacker::smk_fetch_reap() - ERROR: io_uring_enter() failed");
+			return -1;
+		}
+	}
+
+	cqe = &q->cqes[head & *q->cq_mask];
+	s = (smk)(unsigned long)cqe->user_data;
+	result = cqe->res;
+	__atomic_store_n(q->cq_head, head + 1, __ATOMIC_RELEASE);
+	q->in_flight --;
+	smk_fetch_finish(q, s, result);
+	return 0;
+}
+#endif
+
+/* s is being closed: let its read land, and take it off the done list */
+static void smk_fetch_forget(struct smk_fetch_t * q, smk s)
+{
+	unsigned int i, j;
+#ifdef SMK_HAVE_IO_URING
+
+	while (s->source.file.fetch_state == SMK_FETCH_READING && smk_fetch_reap(q) == 0);
+
+#endif
+
+	for (i = 0, j = 0; i < q->done_count; i ++) {
+		if (q->done[(q->done_head + i) % q->depth] != s) {
+			q->done[(q->done_head + j) % q->depth] = q->done[(q->done_head + i) % q->depth];
+			j ++;
+		}
+	}
+
+	q->done_count = j;
+}
+
+/* Helper functions to do the reading, plus
+	byteswap from LE to host order */
+/* read n bytes from (source) into ret */
+#define smk_read(ret,n) \
+{ \
+	if (s->source.io.read_at(s->source.user, pos, n, ret) < 0) \
+	{ \
+		fprintf(stderr,"libsmacker::smk_read(...) - Errors encountered on read, bailing out (file: %s, line: %lu)\n", __FILE__, (unsigned long)__LINE__); \
+		goto error; \
+	} \
+	pos += (n); \
+}
+
+/* Takes the next ul from a buffer already read (at hp) */
+#define smk_read_ul(p) \
+{ \
+	p = ((unsigned long) hp[3] << 24) | \
+		((unsigned long) hp[2] << 16) | \
+		((unsigned long) hp[1] << 8) | \
+		((unsigned long) hp[0]); \
+	hp += 4; \
+}
+
+/* Size of the fixed part of the header:
+	signature, 5 + 7 + 1 + 4 + 7 ul fields and a dummy */
+#define SMK_HEADER_SIZE	104
+
+/* Refresh RGBA and packed forms of palette entry i */
+static void smk_palette_pack(struct smk_video_t * s, const unsigned int i)
+{
+	unsigned char r, g, b, a;
+	/* null check */
+	assert(s);
+	r = s->palette[i][0];
+	g = s->palette[i][1];
+	b = s->palette[i][2];
+	a = (s->colorkey && i == 0) ? 0x00 : 0xFF;
+	s->palette_rgba[i][0] = r;
+	s->palette_rgba[i][1] = g;
+	s->palette_rgba[i][2] = b;
+	s->palette_rgba[i][3] = a;
+
+	switch (s->format) {
+	case SMK_VIDEO_RGBA8888:
+		/* byte order in memory is the same as palette_rgba */
+		memcpy(&s->palette_packed[i], s->palette_rgba[i], 4);
+		break;
+
+	case SMK_VIDEO_ARGB8888:
+		s->palette_packed[i] = ((unsigned int)a << 24) | ((unsigned int)r << 16) | ((unsigned int)g << 8) | b;
+		break;
+
+	case SMK_VIDEO_RGB565:
+		s->palette_packed[i] = ((unsigned int)(r >> 3) << 11) | ((unsigned int)(g >> 2) << 5) | (b >> 3);
+		break;
+
+	default:
+		s->palette_packed[i] = i;
+	}
+}
+
+/* Merge the changed-block map into rectangles: the changed span of each
+	block row, grown downward while the next row's span touches it. */
+static void smk_dirty_rects(struct smk_video_t * s)
+{
+	const unsigned long bw = (s->w + 3) >> 2;
+	const unsigned long bh = (s->h + 3) >> 2;
+	const unsigned char * d = s->dirty;
+	/* rectangle still being grown (NULL: none), in blocks: x0, y0, x1, y1 */
+	unsigned long * r = NULL;
+	unsigned long row, x0, x1, i;
+	s->dirty_rect_count = 0;
+
+	for (row = 0; row < bh; row ++, d += bw) {
+		for (x0 = 0; x0 < bw && !d[x0]; x0 ++);
+
+		if (x0 == bw) {
+			r = NULL;
+			continue;
+		}
+
+		for (x1 = bw; !d[x1 - 1]; x1 --);
+
+		if (r && x0 <= r[2] && x1 >= r[0]) {
+			if (x0 < r[0])
+				r[0] = x0;
+
+			if (x1 > r[2])
+				r[2] = x1;
+
+			r[3] = row + 1;
+		} else {
+			r = s->dirty_rect + 4 * s->dirty_rect_count ++;
+			r[0] = x0;
+			r[1] = row;
+			r[2] = x1;
+			r[3] = row + 1;
+		}
+	}
+
+	/* to pixels, clipped to the frame */
+	for (i = 0; i < s->dirty_rect_count; i ++) {
+		r = s->dirty_rect + 4 * i;
+		r[0] <<= 2;
+		r[1] <<= 2;
+		r[2] = ((r[2] << 2) < s->w ? (r[2] << 2) : s->w) - r[0];
+		r[3] = ((r[3] << 2) < s->h ? (r[3] << 2) : s->h) - r[1];
+	}
+
+	s->dirty_rect_valid = 1;
+}
+
+/* Switch video output to a new buffer (NULL: internal) and/or format,
+	carrying the last decoded frame over: unchanged blocks are never
+	rewritten, so the new target has to start out with it. */
+static char smk_video_output(struct smk_video_t * s, unsigned char * buffer, unsigned long stride, const unsigned char format)
+{
+	const unsigned char base = format & ~SMK_VIDEO_COLORKEY;
+	const unsigned long h = (s->h + 3) & ~3UL;
+	unsigned long y, bpp;
+	assert(s);
+
+	if (base > SMK_VIDEO_RGB565) {
+		fprintf(stderr, "libsmacker::smk_video_output() - ERROR: unknown video format %u\n", format);
+		return -1;
+	}
+
+	bpp = (base == SMK_VIDEO_INDEXED ? 1 : (base == SMK_VIDEO_RGB565 ? 2 : 4));
+
+	/* blocks are 4 pixels wide: the last one in a row may reach past w */
+	if (buffer && stride < ((s->w + 3) & ~3UL) * bpp) {
+		fprintf(stderr, "libsmacker::smk_video_output() - ERROR: stride %lu is too small for frame width %lu\n", stride, s->w);
+		return -1;
+	}
+
+	/* First make sure "frame" holds the last decoded indices */
+	if (s->format == SMK_VIDEO_INDEXED && s->target != s->frame) {
+		for (y = 0; y < s->h; y ++)
+			memcpy(&s->frame[y * s->pitch], &s->target[y * s->stride], s->w);
+	}
+
+	/* Internal buffer for color output: only when the caller has none */
+	if (s->color)
+		smk_free(s->color);
+
+	s->user_target = buffer;
+	s->user_stride = stride;
+
+	if (buffer == NULL) {
+		if (base == SMK_VIDEO_INDEXED) {
+			buffer = s->frame;
+			stride = s->pitch;
+		} else {
+			stride = s->pitch * bpp;
+			smk_malloc(s->color, stride * h);
+			buffer = s->color;
+		}
+	}
+
+	s->target = buffer;
+	s->stride = stride;
+	s->format = base;
+	s->colorkey = ((format & SMK_VIDEO_COLORKEY) != 0);
+	s->bpp = (unsigned char)bpp;
+	s->convert = (bpp == 2 ? smk_convert16 : smk_convert32);
+
+	for (y = 0; y < 256; y ++)
+		smk_palette_pack(s, y);
+
+	/* Now fill the new target from "frame" */
+	if (base != SMK_VIDEO_INDEXED)
+		s->convert(s->frame, s->pitch, s->target, s->stride, s->palette_packed, s->w, s->h);
+	else if (s->target != s->frame) {
+		for (y = 0; y < s->h; y ++)
+			memcpy(&s->target[y * s->stride], &s->frame[y * s->pitch], s->w);
+	}
+
+	return 0;
+}
+
+#ifdef SMK_HAVE_MMAP
+/* Hint to the kernel how the chunk for frame f will be read,
+	if it sits in a file mapped by smk_io_file_map */
+static void smk_map_advise(smk s, const unsigned long f, const int advice)
+{
+	/* madvise wants a page-aligned start */
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	unsigned char * const start = (unsigned char *)((size_t)s->source.chunk_data[f] & ~(page - 1));
+
+	if (s->source.io.read_at == smk_io_file_read_at)
+		madvise(start, (size_t)(s->source.chunk_data[f] - start) + s->chunk_size[f], advice);
+}
+#endif
+
+/* PUBLIC FUNCTIONS */
+/* open an smk (from a generic Source) */
+static smk smk_open_generic(const struct smk_io_t * io, void * user, const unsigned char process_mode)
+{
+	/* Smacker structure we intend to work on / return */
+	smk s;
+	/* Temporary variables */
+	long temp_l;
+	unsigned long temp_u;
+	/* read position, and place in a buffer already read, used by macros above */
+	unsigned long pos = 0;
+	const unsigned char * hp;
+	/* fixed-size header, and the frame size table, read in one go each */
+	unsigned char header[SMK_HEADER_SIZE];
+	unsigned char * size_table = NULL;
+	/* start of chunk data, when mapped */
+	const unsigned char * map;
+	/* video hufftrees are stored as a large chunk (bitstream)
+		these vars are used to load, then decode them */
+	unsigned char * hufftree_chunk = NULL;
+	unsigned long tree_size;
+	/* running total of chunk sizes, or the largest one */
+	unsigned long offset;
+	/* progressive mode: chunks are left to a loader thread */
+#ifdef SMK_HAVE_THREADS
+	char progressive = 0;
+#endif
+	char loading = 0;
+	/* a bitstream struct */
+	struct smk_bit_t bs;
+
+	/** **/
+	/* safe malloc the structure */
+	if ((s = calloc(1, sizeof(struct smk_t))) == NULL) {
+		perror("libsmacker::smk_open_generic() - ERROR: failed to malloc() smk structure");
+
+		if (io->close)
+			io->close(user);
+
+		return NULL;
+	}
+
+	/* the smk owns the source from here on: smk_close closes it */
+	s->source.io = *io;
+	s->source.user = user;
+
+	/* The header is fixed-size up to the frame size table: read it all at once */
+	smk_read(header, SMK_HEADER_SIZE);
+	hp = header + 4;
+
+	/* Check for a valid signature */
+	if (header[0] != 'S' || header[1] != 'M' || header[2] != 'K') {
+		fprintf(stderr, "libsmacker::smk_open_generic - ERROR: invalid SMKn signature (got: %.3s)\n", header);
+		goto error;
+	}
+
+	/* .smk file version */
+	s->video.v = header[3];
+
+	if (s->video.v != '2' && s->video.v != '4') {
+		fprintf(stderr, "libsmacker::smk_open_generic - Warning: invalid SMK version %c (expected: 2 or 4)\n", s->video.v);
+
+		/* take a guess */
+		if (s->video.v < '4')
+			s->video.v = '2';
+		else
+			s->video.v = '4';
+
+		fprintf(stderr, "\tProcessing will continue as type %c\n", s->video.v);
+	}
+
+	/* width, height, total num frames */
+	smk_read_ul(s->video.w);
+	smk_read_ul(s->video.h);
+	smk_read_ul(s->f);
+	/* frames per second calculation */
+	smk_read_ul(temp_u);
+	temp_l = (int)temp_u;
+
+	if (temp_l > 0) {
+		/* millisec per frame */
+		s->usf = temp_l * 1000;
+	} else if (temp_l < 0) {
+		/* 10 microsec per frame */
+		s->usf = temp_l * -10;
+	} else {
+		/* defaults to 10 usf (= 100000 microseconds) */
+		s->usf = 100000;
+	}
+
+	/* Video flags follow.
+		Ring frame is important to libsmacker.
+		Y scale / Y interlace go in the Video flags.
+		The user should scale appropriately. */
+	smk_read_ul(temp_u);
+
+	if (temp_u & 0x01)
+		s->ring_frame = 1;
+
+	if (temp_u & 0x02)
+		s->video.y_scale_mode = SMK_FLAG_Y_DOUBLE;
+
+	if (temp_u & 0x04) {
+		if (s->video.y_scale_mode == SMK_FLAG_Y_DOUBLE)
+			fputs("libsmacker::smk_open_generic - Warning: SMK file specifies both Y-Double AND Y-Interlace.\n", stderr);
+
+		s->video.y_scale_mode = SMK_FLAG_Y_INTERLACE;
+	}
+
+	/* Max buffer size for each audio track - used to pre-allocate buffers */
+	for (temp_l = 0; temp_l < 7; temp_l ++)
+		smk_read_ul(s->audio[temp_l].max_buffer);
+
+	/* Read size of "hufftree chunk" - save for later. */
+	smk_read_ul(tree_size);
+
+	/* "unpacked" sizes of each huff tree */
+	for (temp_l = 0; temp_l < 4; temp_l ++)
+		smk_read_ul(s->video.tree_size[temp_l]);
+
+	/* read audio rate data */
+	for (temp_l = 0; temp_l < 7; temp_l ++) {
+		smk_read_ul(temp_u);
+
+		if (temp_u & 0x40000000) {
+			/* Audio track specifies "exists" flag, malloc structure and copy components. */
+			s->audio[temp_l].exists = 1;
+			/* and for all audio tracks (unless just looking) */
+			if (process_mode != SMK_MODE_INFO)
+				smk_malloc(s->audio[temp_l].buffer, s->audio[temp_l].max_buffer);
+
+			if (temp_u & 0x80000000)
+				s->audio[temp_l].compress = 1;
+
+			s->audio[temp_l].bitdepth = ((temp_u & 0x20000000) ? 16 : 8);
+			s->audio[temp_l].channels = ((temp_u & 0x10000000) ? 2 : 1);
+
+			if (temp_u & 0x0c000000) {
+				fprintf(stderr, "libsmacker::smk_open_generic - Warning: audio track %ld is compressed with Bink (perceptual) Audio Codec: this is currently unsupported by libsmacker\n", temp_l);
+				s->audio[temp_l].compress = 2;
+			}
+
+			/* Bits 25 & 24 are unused. */
+			s->audio[temp_l].rate = (temp_u & 0x00FFFFFF);
+		}
+	}
+
+	/* (then a Dummy field) */
+	/* FrameSizes and Keyframe marker are stored together. */
+	smk_malloc(s->keyframe, (s->f + s->ring_frame));
+	smk_malloc(s->chunk_size, (s->f + s->ring_frame) * sizeof(unsigned long));
+	smk_malloc(size_table, (s->f + s->ring_frame) * 4);
+	smk_read(size_table, (s->f + s->ring_frame) * 4);
+	hp = size_table;
+
+	for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++) {
+		smk_read_ul(s->chunk_size[temp_u]);
+
+		/* Set Keyframe */
+		if (s->chunk_size[temp_u] & 0x01)
+			s->keyframe[temp_u] = 1;
+
+		/* Bits 1 is used, but the purpose is unknown. */
+		s->chunk_size[temp_u] &= 0xFFFFFFFC;
+	}
+
+	smk_free(size_table);
+	/* That was easy... Now read FrameTypes! */
+	smk_malloc(s->frame_type, (s->f + s->ring_frame));
+	smk_read(s->frame_type, (s->f + s->ring_frame));
+
+	if (process_mode == SMK_MODE_INFO) {
+		/* MODE_INFO: that's all there is to know, without decoding anything */
+		s->mode = SMK_MODE_INFO;
+
+		if (s->source.io.close)
+			s->source.io.close(s->source.user);
+
+		s->source.io.close = NULL;
+		return s;
+	}
+
+	/* HuffmanTrees
+		We know the sizes already: read and assemble into
+		something actually parse-able at run-time */
+	smk_malloc(hufftree_chunk, tree_size);
+	smk_read(hufftree_chunk, tree_size);
+	/* set up a Bitstream */
+	smk_bs_init(&bs, hufftree_chunk, tree_size);
+	s->video.tree_hash = smk_hash(hufftree_chunk, tree_size);
+
+	/* create some tables */
+	for (temp_u = 0; temp_u < 4; temp_u ++) {
+		if (! smk_huff16_build(&s->video.tree[temp_u], &bs, s->video.tree_size[temp_u])) {
+			fprintf(stderr, "libsmacker::smk_open_generic - ERROR: failed to create huff16 tree %lu\n", temp_u);
+			goto error;
+		}
+	}
+
+	/* clean up */
+	smk_free(hufftree_chunk);
+	/* Go ahead and malloc storage for the video frame */
+	/* (blocks are 4x4: pad rows and the last block row to whole blocks,
+		in case w or h isn't a multiple of 4) */
+	s->video.pitch = (s->video.w + 3) & ~3UL;
+	smk_malloc(s->video.frame, s->video.pitch * ((s->video.h + 3) & ~3UL));
+	s->video.target = s->video.frame;
+	s->video.stride = s->video.pitch;
+	s->video.format = SMK_VIDEO_INDEXED;
+	s->video.bpp = 1;
+	/* Changed-block map, and room for a dirty rectangle per block row */
+	smk_malloc(s->video.dirty, ((s->video.w + 3) >> 2) * ((s->video.h + 3) >> 2));
+	smk_malloc(s->video.dirty_rect, 4 * sizeof(unsigned long) * ((s->video.h + 3) >> 2));
+	/* Block commands: at worst, a header and 8 values for every block */
+	smk_malloc(s->video.cmds.cmd, 10 * sizeof(unsigned short) * ((s->video.w + 3) >> 2) * ((s->video.h + 3) >> 2));
+	smk_malloc(s->video.cmds.row, sizeof(unsigned long) * ((s->video.h + 3) >> 2));
+
+	for (temp_u = 0; temp_u < 256; temp_u ++)
+		smk_palette_pack(&s->video, temp_u);
+	s->video.blocks = smk_blocks_select();
+	/* final processing: depending on ProcessMode, handle what to do with rest of file data */
+	s->mode = process_mode;
+
+	if (s->mode == SMK_MODE_MMAP && s->source.io.map == NULL) {
+		fputs("libsmacker::smk_open_generic - Warning: source can't be mapped, using SMK_MODE_MEMORY.\n", stderr);
+		s->mode = SMK_MODE_MEMORY;
+	}
+
+	/* progressive mode is memory mode, with the chunks read in later */
+	if (s->mode == SMK_MODE_PROGRESSIVE) {
+#ifdef SMK_HAVE_THREADS
+		progressive = 1;
+#else
+		fputs("libsmacker::smk_open_generic - Warning: no background loading on this platform, using SMK_MODE_MEMORY.\n", stderr);
+#endif
+		s->mode = SMK_MODE_MEMORY;
+	}
+
+	/* Handle the rest of the data.
+		For MODE_MEMORY, read the chunks and store; for MODE_MMAP, map them */
+	if (s->mode == SMK_MODE_MEMORY || s->mode == SMK_MODE_MMAP) {
+		/* chunks are stored back to back: get them all at once */
+		smk_malloc(s->source.chunk_data, (s->f + s->ring_frame) * sizeof(unsigned char *));
+		offset = 0;
+
+		for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++) {
+			if (s->chunk_size[temp_u] > ~0UL - offset) {
+				fputs("libsmacker::smk_open_generic - ERROR: total chunk size overflows.\n", stderr);
+				goto error;
+			}
+
+			offset += s->chunk_size[temp_u];
+		}
+
+		/* (streams report ~0UL, so only a known size can rule this out) */
+		if (pos > s->source.io.size(s->source.user) || offset > s->source.io.size(s->source.user) - pos) {
+			fputs("libsmacker::smk_open_generic - ERROR: chunks run past the end of the file.\n", stderr);
+			goto error;
+		}
+
+		if (s->mode == SMK_MODE_MMAP) {
+			if ((map = s->source.io.map(s->source.user, pos, offset)) == NULL) {
+				fputs("libsmacker::smk_open_generic - ERROR: failed to map chunks.\n", stderr);
+				goto error;
+			}
+		} else {
+			/* (no need to zero-fill: it's all about to be overwritten) */
+			if ((s->source.arena = malloc(offset ? offset : 1)) == NULL) {
+				perror("libsmacker::smk_open_generic() - ERROR: failed to malloc() chunk arena");
+				goto error;
+			}
+
+			map = s->source.arena;
+#ifdef SMK_HAVE_THREADS
+
+			/* (if the loader won't start, read them all now after all) */
+			if (progressive)
+				loading = ((s->source.load = smk_load_start(s, pos, offset)) != NULL);
+
+#endif
+
+			if (! loading) {
+				smk_read(s->source.arena, offset);
+
+				/* everything is in memory: done with the source */
+				if (s->source.io.close)
+					s->source.io.close(s->source.user);
+
+				s->source.io.close = NULL;
+			}
+		}
+
+		offset = 0;
+
+		for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++) {
+			s->source.chunk_data[temp_u] = (unsigned char *)map + offset;
+			offset += s->chunk_size[temp_u];
+		}
+	} else {
+		/* MODE_STREAM: don't read anything now, just precompute offsets. */
+		smk_malloc(s->source.file.chunk_offset, (s->f + s->ring_frame) * sizeof(unsigned long));
+		/* ...and find the largest chunk, to size the read buffer */
+		offset = 1;
+
+		for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++) {
+			s->source.file.chunk_offset[temp_u] = pos;
+
+			if (s->chunk_size[temp_u] > offset)
+				offset = s->chunk_size[temp_u];
+
+			pos += s->chunk_size[temp_u];
+		}
+
+		/* a short file still opens: frames past the end fail to render */
+		if (pos > s->source.io.size(s->source.user))
+			fputs("libsmacker::smk_open_generic - Warning: file is shorter than its frames add up to.\n", stderr);
+
+		smk_malloc(s->source.file.buffer, offset);
+		s->source.file.buffer_size = offset;
+	}
+
+	return s;
+error:
+
+	if (size_table)
+		smk_free(size_table);
+
+	if (hufftree_chunk)
+		smk_free(hufftree_chunk);
+
+	smk_close(s);
+	return NULL;
+}
+
+/* open an smk (from a memory buffer) */
+smk smk_open_memory(const unsigned char * buffer, const unsigned long size)
+{
+	smk s = NULL;
+	struct smk_io_memory_t * io = NULL;
+
+	if (buffer == NULL) {
+		fputs("libsmacker::smk_open_memory() - ERROR: buffer pointer is NULL\n", stderr);
+		return NULL;
+	}
+
+	/* set up the built-in memory source */
+	smk_malloc(io, sizeof(struct smk_io_memory_t));
+	io->buffer = buffer;
+	io->size = size;
+
+	if (!(s = smk_open_generic(&smk_io_memory, io, SMK_MODE_MEMORY)))
+		fprintf(stderr, "libsmacker::smk_open_memory(buffer,%lu) - ERROR: Fatal error in smk_open_generic, returning NULL.\n", size);
+
+	return s;
+}
+
+/* open an smk (from a memory buffer), without copying chunks out of it */
+smk smk_open_memory_borrowed(const unsigned char * buffer, const unsigned long size)
+{
+	smk s = NULL;
+	struct smk_io_memory_t * io = NULL;
+
+	if (buffer == NULL) {
+		fputs("libsmacker::smk_open_memory_borrowed() - ERROR: buffer pointer is NULL\n", stderr);
+		return NULL;
+	}
+
+	/* set up the built-in memory source, and "map" chunks straight from it */
+	smk_malloc(io, sizeof(struct smk_io_memory_t));
+	io->buffer = buffer;
+	io->size = size;
+
+	if (!(s = smk_open_generic(&smk_io_memory, io, SMK_MODE_MMAP)))
+		fprintf(stderr, "libsmacker::smk_open_memory_borrowed(buffer,%lu) - ERROR: Fatal error in smk_open_generic, returning NULL.\n", size);
+
+	return s;
+}
+
+/* open an smk (from a file) */
+smk smk_open_filepointer(FILE * file, const unsigned char mode)
+{
+	smk s = NULL;
+	struct smk_io_file_t * io = NULL;
+	long base;
+
+	if (file == NULL) {
+		fputs("libsmacker::smk_open_filepointer() - ERROR: file pointer is NULL\n", stderr);
+		return NULL;
+	}
+
+	/* set up the built-in file source: it reads from where the file is now,
+		and closes it when done */
+	smk_malloc(io, sizeof(struct smk_io_file_t));
+	io->fp = file;
+
+	if ((base = ftell(file)) > 0)
+		io->base = (unsigned long)base;
+
+#ifdef SMK_HAVE_PREAD
+	/* (pread needs the descriptor itself to seek) */
+	if (base < 0 || lseek(fileno(file), 0, SEEK_CUR) < 0)
+#else
+	if (base < 0)
+#endif
+	{
+		/* A pipe or the like: only modes that read it all in one go, in order */
+		if (mode == SMK_MODE_DISK || mode == SMK_MODE_MMAP) {
+			fprintf(stderr, "libsmacker::smk_open_filepointer(file,%u) - ERROR: file can't seek: open it with SMK_MODE_MEMORY\n", mode);
+			smk_io_file_close(io);
+			return NULL;
+		}
+
+		io->stream = 1;
+	}
+
+	if (!(s = smk_open_generic(&smk_io_file, io, mode)))
+		fprintf(stderr, "libsmacker::smk_open_filepointer(file,%u) - ERROR: Fatal error in smk_open_generic, returning NULL.\n", mode);
+
+	return s;
+}
+
+/* open an smk (from a file) */
+smk smk_open_file(const char * filename, const unsigned char mode)
+{
+	FILE * fp;
+
+	if (filename == NULL) {
+		fputs("libsmacker::smk_open_file() - ERROR: filename is NULL\n", stderr);
+		return NULL;
+	}
+
+	if (!(fp = fopen(filename, "rb"))) {
+		fprintf(stderr, "libsmacker::smk_open_file(%s,%u) - ERROR: could not open file\n", filename, mode);
+		perror("\tError reported was");
+		goto error;
+	}
+
+	/* kick processing to smk_open_filepointer */
+	return smk_open_filepointer(fp, mode);
+	/* fall through, return s or null */
+error:
+	return NULL;
+}
+
+/* open an smk (through caller-supplied I/O callbacks) */
+smk smk_open_io(const struct smk_io_t * io, void * user, const unsigned char mode)
+{
+	smk s = NULL;
+
+	if (io == NULL || io->read_at == NULL || io->size == NULL) {
+		fputs("libsmacker::smk_open_io() - ERROR: io, io->read_at or io->size is NULL\n", stderr);
+		return NULL;
+	}
+
+	if (!(s = smk_open_generic(io, user, mode)))
+		fprintf(stderr, "libsmacker::smk_open_io(io,user,%u) - ERROR: Fatal error in smk_open_generic, returning NULL.\n", mode);
+
+	return s;
+}
+
+/* close out an smk file and clean up memory */
+void smk_close(smk s)
+{
+	unsigned long u;
+
+	if (s == NULL) {
+		fputs("libsmacker::smk_close() - ERROR: smk is NULL\n", stderr);
+		return;
+	}
+
+#ifdef SMK_HAVE_THREADS
+	/* (the pipeline may still be decoding with the trees) */
+	if (s->pipe)
+		smk_pipe_stop(s->pipe);
+
+#endif
+
+	/* free video sub-components */
+	for (u = 0; u < 4; u ++) {
+		if (s->video.tree[u].tree) free(s->video.tree[u].tree);
+
+		if (s->video.tree[u].table) free(s->video.tree[u].table);
+	}
+
+	if (s->video.frame)
+		smk_free(s->video.frame);
+
+	if (s->video.color)
+		smk_free(s->video.color);
+
+	if (s->video.dirty)
+		smk_free(s->video.dirty);
+
+	if (s->video.dirty_rect)
+		smk_free(s->video.dirty_rect);
+
+	if (s->video.cmds.cmd)
+		smk_free(s->video.cmds.cmd);
+
+	if (s->video.cmds.row)
+		smk_free(s->video.cmds.row);
+
+	if (s->video.index.mark)
+		smk_free(s->video.index.mark);
+
+	if (s->video.index.state)
+		smk_free(s->video.index.state);
+
+	if (s->video.index.hash)
+		smk_free(s->video.index.hash);
+
+	/* free audio sub-components */
+#ifdef SMK_HAVE_THREADS
+	if (s->audio_worker)
+		smk_audio_worker_stop(s->audio_worker);
+
+#endif
+
+	for (u = 0; u < 7; u++) {
+		if (s->audio[u].buffer)
+			smk_free(s->audio[u].buffer);
+	}
+
+	if (s->keyframe)
+		smk_free(s->keyframe);
+
+	if (s->frame_type)
+		smk_free(s->frame_type);
+
+	if (s->mode == SMK_MODE_DISK) {
+		/* disk-mode */
+#ifdef SMK_HAVE_THREADS
+		if (s->source.file.ra)
+			smk_readahead_stop(s->source.file.ra);
+
+#endif
+
+		if (s->source.file.fetch)
+			smk_fetch_forget(s->source.file.fetch, s);
+
+		if (s->source.file.fetch_buffer)
+			smk_free(s->source.file.fetch_buffer);
+
+		if (s->source.file.chunk_offset)
+			smk_free(s->source.file.chunk_offset);
+
+		if (s->source.file.buffer)
+			smk_free(s->source.file.buffer);
+	} else {
+#ifdef SMK_HAVE_THREADS
+		/* (a progressive load still going is called off first) */
+		if (s->source.load)
+			smk_load_stop(s->source.load);
+
+#endif
+
+		/* mem- or mmap-mode: chunks point into one block of memory */
+		if (s->source.arena)
+			free(s->source.arena);
+
+		if (s->source.chunk_data != NULL)
+			smk_free(s->source.chunk_data);
+	}
+
+	/* and let go of the source (for mmap-mode, only now unmapping it) */
+	if (s->source.io.close)
+		s->source.io.close(s->source.user);
+
+	if (s->chunk_size)
+		smk_free(s->chunk_size);
+
+	smk_free(s);
+}
+
+/* per-frame keyframe flags */
+const unsigned char * smk_info_keyframes(const smk object)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_info_keyframes() - ERROR: smk is NULL\n", stderr);
+		return NULL;
+	}
+
+	return object->keyframe;
+}
+
+/* tell some info about the file */
+char smk_info_all(const smk object, unsigned long * frame, unsigned long * frame_count, double * usf)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_info_all() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	if (!frame && !frame_count && !usf) {
+		fputs("libsmacker::smk_info_all(object,frame,frame_count,usf) - ERROR: Request for info with all-NULL return references\n", stderr);
+		goto error;
+	}
+
+	if (frame)
+		*frame = (object->cur_frame % object->f);
+
+	if (frame_count)
+		*frame_count = object->f;
+
+	if (usf)
+		*usf = object->usf;
+
+	return 0;
+error:
+	return -1;
+}
+
+char smk_info_video(const smk object, unsigned long * w, unsigned long * h, unsigned char * y_scale_mode)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_info_video() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	if (!w && !h && !y_scale_mode) {
+		fputs("libsmacker::smk_info_all(object,w,h,y_scale_mode) - ERROR: Request for info with all-NULL return references\n", stderr);
+		return -1;
+	}
+
+	if (w)
+		*w = object->video.w;
+
+	if (h)
+		*h = object->video.h;
+
+	if (y_scale_mode)
+		*y_scale_mode = object->video.y_scale_mode;
+
+	return 0;
+}
+
+char smk_info_audio(const smk object, unsigned char * track_mask, unsigned char channels[7], unsigned char bitdepth[7], unsigned long audio_rate[7])
+{
+	unsigned char i;
+
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_info_audio() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	if (!track_mask && !channels && !bitdepth && !audio_rate) {
+		fputs("libsmacker::smk_info_audio(object,track_mask,channels,bitdepth,audio_rate) - ERROR: Request for info with all-NULL return references\n", stderr);
+		return -1;
+	}
+
+	if (track_mask) {
+		*track_mask = ((object->audio[0].exists) |
+				((object->audio[1].exists) << 1) |
+				((object->audio[2].exists) << 2) |
+				((object->audio[3].exists) << 3) |
+				((object->audio[4].exists) << 4) |
+				((object->audio[5].exists) << 5) |
+				((object->audio[6].exists) << 6));
+	}
+
+	if (channels) {
+		for (i = 0; i < 7; i ++)
+			channels[i] = object->audio[i].channels;
+	}
+
+	if (bitdepth) {
+		for (i = 0; i < 7; i ++)
+			bitdepth[i] = object->audio[i].bitdepth;
+	}
+
+	if (audio_rate) {
+		for (i = 0; i < 7; i ++)
+			audio_rate[i] = object->audio[i].rate;
+	}
+
+	return 0;
+}
+
+/* Enable-disable switches */
+char smk_enable_all(smk object, const unsigned char mask)
+{
+	unsigned char i;
+
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_enable_all() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	/* set video-enable */
+	object->video.enable = (mask & 0x80);
+
+	for (i = 0; i < 7; i ++) {
+		if (object->audio[i].exists)
+			object->audio[i].enable = (mask & (1 << i));
+	}
+
+	return 0;
+}
+
+char smk_enable_video(smk object, const unsigned char enable)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_enable_video() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	object->video.enable = enable;
+	return 0;
+}
+
+char smk_enable_audio(smk object, const unsigned char track, const unsigned char enable)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_enable_audio() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	object->audio[track].enable = enable;
+	return 0;
+}
+
+/* read chunks ahead of playback on an I/O thread */
+char smk_set_readahead(smk object, const unsigned long window, const unsigned long budget)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_set_readahead() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	if (object->mode != SMK_MODE_DISK) {
+		fputs("libsmacker::smk_set_readahead() - ERROR: read-ahead needs SMK_MODE_DISK\n", stderr);
+		return -1;
+	}
+
+#ifdef SMK_HAVE_THREADS
+
+	if (object->source.file.ra)
+		smk_readahead_stop(object->source.file.ra);
+
+	object->source.file.ra = NULL;
+
+	if (window && (object->source.file.ra = smk_readahead_start(object, window, budget)) == NULL)
+		return -1;
+
+	return 0;
+#else
+	(void)window;
+	(void)budget;
+	fputs("libsmacker::smk_set_readahead() - ERROR: read-ahead not supported on this platform\n", stderr);
+	return -1;
+#endif
+}
+
+/* decode audio on a thread of its own */
+char smk_set_audio_thread(smk object, const unsigned char enable)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_set_audio_thread() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	if (object->mode == SMK_MODE_INFO) {
+		fputs("libsmacker::smk_set_audio_thread() - ERROR: smk was opened with SMK_MODE_INFO\n", stderr);
+		return -1;
+	}
+
+#ifdef SMK_HAVE_THREADS
+
+	if (! enable && object->audio_worker) {
+		smk_audio_worker_stop(object->audio_worker);
+		object->audio_worker = NULL;
+	} else if (enable && ! object->audio_worker &&
+		(object->audio_worker = smk_audio_worker_start(object)) == NULL)
+		return -1;
+
+	return 0;
+#else
+
+	if (! enable)
+		return 0;
+
+	fputs("libsmacker::smk_set_audio_thread() - ERROR: threads not supported on this platform\n", stderr);
+	return -1;
+#endif
+}
+
+/* decode the next frame's video bitstream while this one is reconstructed */
+char smk_set_pipeline(smk object, const unsigned char enable)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_set_pipeline() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	if (object->mode != SMK_MODE_MEMORY && object->mode != SMK_MODE_MMAP) {
+		fputs("libsmacker::smk_set_pipeline() - ERROR: the pipeline needs chunks in memory (SMK_MODE_MEMORY, _MMAP or _PROGRESSIVE)\n", stderr);
+		return -1;
+	}
+
+#ifdef SMK_HAVE_THREADS
+
+	if (! enable && object->pipe) {
+		smk_pipe_stop(object->pipe);
+		object->pipe = NULL;
+	} else if (enable && ! object->pipe &&
+		(object->pipe = smk_pipe_start(object)) == NULL)
+		return -1;
+
+	return 0;
+#else
+
+	if (! enable)
+		return 0;
+
+	fputs("libsmacker::smk_set_pipeline() - ERROR: threads not supported on this platform\n", stderr);
+	return -1;
+#endif
+}
+
+/* open a reconstruction pool */
+smk_pool smk_pool_open(const unsigned int threads)
+{
+#ifdef SMK_HAVE_THREADS
+	struct smk_pool_t * pool = NULL;
+	unsigned int i;
+
+	if (threads == 0) {
+		fputs("libsmacker::smk_pool_open() - ERROR: a pool needs at least one thread\n", stderr);
+		return NULL;
+	}
+
+	smk_malloc(pool, sizeof(struct smk_pool_t));
+	smk_malloc(pool->thread, threads * sizeof(pthread_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	/* (make do with the threads that did start) */
+	for (i = 0; i < threads; i ++) {
+		if (pthread_create(&pool->thread[i], NULL, smk_pool_thread, pool))
+			break;
+	}
+
+	if ((pool->threads = i) < threads)
+		fprintf(stderr, "libsmacker::smk_pool_open(%u) - Warning: only %u threads started\n", threads, i);
+
+	if (i == 0) {
+		smk_pool_close(pool);
+		return NULL;
+	}
+
+	return pool;
+#else
+	(void)threads;
+	fputs("libsmacker::smk_pool_open() - ERROR: threads not supported on this platform\n", stderr);
+	return NULL;
+#endif
+}
+
+/* close a reconstruction pool */
+void smk_pool_close(smk_pool pool)
+{
+#ifdef SMK_HAVE_THREADS
+	unsigned int i;
+
+	if (pool == NULL) {
+		fputs("libsmacker::smk_pool_close() - ERROR: pool is NULL\n", stderr);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->threads; i ++)
+		pthread_join(pool->thread[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	smk_free(pool->thread);
+	smk_free(pool);
+#else
+	(void)pool;
+#endif
+}
+
+/* reconstruct video on a pool */
+char smk_set_pool(smk object, smk_pool pool)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_set_pool() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	if (object->mode == SMK_MODE_INFO) {
+		fputs("libsmacker::smk_set_pool() - ERROR: smk was opened with SMK_MODE_INFO\n", stderr);
+		return -1;
+	}
+
+#ifdef SMK_HAVE_THREADS
+
+	/* (the pipeline may be decoding on the pool there was) */
+	if (object->pipe)
+		smk_pipe_wait(object->pipe);
+
+	object->video.pool = pool;
+	return 0;
+#else
+
+	if (pool == NULL)
+		return 0;
+
+	fputs("libsmacker::smk_set_pool() - ERROR: threads not supported on this platform\n", stderr);
+	return -1;
+#endif
+}
+
+/* Entropy index (smk_set_index, smk_save_index, smk_load_index).
+	A sidecar file is a header:
+		"SMKI", version, frames, w, h, tree hash, interval
+	(ul each), then per frame: a byte (1 if indexed), the hash of its
+	video record, and its checkpoints of 32 bytes each:
+		bit (ul), tree caches (4 x 3 us), run left (us), type, typedata
+	all little-endian. */
+#define SMK_INDEX_MAGIC	"SMKI"
+#define SMK_INDEX_VERSION	1
+#define SMK_INDEX_HEADER	28
+#define SMK_INDEX_MARK	32
+
+/* Set up an empty index for "frames" frames of "bh" block rows */
+static void smk_index_alloc(struct smk_index_t * x, const unsigned long interval, const unsigned long frames, const unsigned long bh)
+{
+	x->interval = interval;
+	x->frames = frames;
+	/* (none at row 0: every frame starts there) */
+	x->marks = (bh ? (bh - 1) / interval : 0);
+
+	if (x->marks)
+		smk_malloc(x->mark, frames * x->marks * sizeof(struct smk_mark_t));
+
+	smk_malloc(x->state, frames);
+	smk_malloc(x->hash, frames * sizeof(unsigned long));
+	x->indexed = 0;
+}
+
+/* Drop an index (keeping the stats) */
+static void smk_index_free(struct smk_index_t * x)
+{
+	if (x->mark)
+		smk_free(x->mark);
+
+	if (x->state)
+		smk_free(x->state);
+
+	if (x->hash)
+		smk_free(x->hash);
+
+	x->interval = 0;
+	x->frames = 0;
+	x->marks = 0;
+	x->indexed = 0;
+}
+
+/* Wait for the pipeline, if any, to be done with the index */
+static void smk_index_sync(smk s)
+{
+#ifdef SMK_HAVE_THREADS
+
+	if (s->pipe)
+		smk_pipe_wait(s->pipe);
+
+#else
+	(void)s;
+#endif
+}
+
+static void smk_index_put(unsigned char * b, const unsigned long v, const unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i ++)
+		b[i] = (unsigned char)(v >> (i * 8));
+}
+
+static unsigned long smk_index_get(const unsigned char * b, const unsigned int n)
+{
+	unsigned long v = 0;
+	unsigned int i;
+
+	for (i = n; i > 0; i --)
+		v = (v << 8) | b[i - 1];
+
+	return v;
+}
+
+/* record an entropy index */
+char smk_set_index(smk object, const unsigned long interval)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_set_index() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	if (object->mode == SMK_MODE_INFO) {
+		fputs("libsmacker::smk_set_index() - ERROR: smk was opened with SMK_MODE_INFO\n", stderr);
+		return -1;
+	}
+
+	smk_index_sync(object);
+
+	if (interval == object->video.index.interval)
+		return 0;
+
+	smk_index_free(&object->video.index);
+
+	if (interval)
+		smk_index_alloc(&object->video.index, interval, object->f + object->ring_frame, (object->video.h + 3) >> 2);
+
+	return 0;
+}
+
+/* how much of the index is there, and how much it's used */
+char smk_get_index_stats(const smk object, unsigned long * indexed, unsigned long * sliced)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_get_index_stats() - ERROR: smk is NULL\n", stderr);
+		return -1;
+	}
+
+	smk_index_sync(object);
+
+	if (indexed)
+		*indexed = object->video.index.indexed;
+
+	if (sliced)
+		*sliced = object->video.index.sliced;
+
+	return 0;
+}
+
+/* write the entropy index to a sidecar file */
+char smk_save_index(const smk object, const char * filename)
+{
+	const struct smk_index_t * x;
+	const struct smk_mark_t * m;
+	unsigned char * buf = NULL, * b;
+	unsigned long size, f, i, j, k;
+	FILE * fp;
+
+	/* null check */
+	if (object == NULL || filename == NULL) {
+		fputs("libsmacker::smk_save_index() - ERROR: smk or filename is NULL\n", stderr);
+		return -1;
+	}
+
+	x = &object->video.index;
+
+	if (x->interval == 0) {
+		fputs("libsmacker::smk_save_index() - ERROR: no index (see smk_set_index)\n", stderr);
+		return -1;
 	}
 
-	/* Video flags follow.
-		Ring frame is important to libsmacker.
-		Y scale / Y interlace go in the Video flags.
-		The user should scale appropriately. */
-	smk_read_ul(temp_u);
+	smk_index_sync(object);
+	size = SMK_INDEX_HEADER + x->frames * (5 + x->marks * SMK_INDEX_MARK);
+	smk_malloc(buf, size);
+	memcpy(buf, SMK_INDEX_MAGIC, 4);
+	smk_index_put(buf + 4, SMK_INDEX_VERSION, 4);
+	smk_index_put(buf + 8, x->frames, 4);
+	smk_index_put(buf + 12, object->video.w, 4);
+	smk_index_put(buf + 16, object->video.h, 4);
+	smk_index_put(buf + 20, object->video.tree_hash, 4);
+	smk_index_put(buf + 24, x->interval, 4);
+	b = buf + SMK_INDEX_HEADER;
+
+	for (f = 0; f < x->frames; f ++) {
+		/* (frames not indexed are left zero) */
+		if (x->state[f] != SMK_INDEX_NONE) {
+			b[0] = 1;
+			smk_index_put(b + 1, x->hash[f], 4);
+
+			for (i = 0; i < x->marks; i ++) {
+				m = &x->mark[f * x->marks + i];
+				k = 5 + i * SMK_INDEX_MARK;
+				smk_index_put(b + k, m->bit, 4);
+
+				for (j = 0; j < 12; j ++)
+					smk_index_put(b + k + 4 + j * 2, m->cache[j / 3][j % 3], 2);
+
+				smk_index_put(b + k + 28, m->left, 2);
+				b[k + 30] = m->type;
+				b[k + 31] = m->typedata;
+			}
+		}
 
-	if (temp_u & 0x01)
-		s->ring_frame = 1;
+		b += 5 + x->marks * SMK_INDEX_MARK;
+	}
 
-	if (temp_u & 0x02)
-		s->video.y_scale_mode = SMK_FLAG_Y_DOUBLE;
+	if ((fp = fopen(filename, "wb")) == NULL) {
+		fprintf(stderr, "libsmacker::smk_save_index() - ERROR: could not open %s for writing\n", filename);
+		perror("\tReason");
+		smk_free(buf);
+		return -1;
+	}
 
-	if (temp_u & 0x04) {
-		if (s->video.y_scale_mode == SMK_FLAG_Y_DOUBLE)
-			fputs("libsmacker::smk_open_generic - Warning: SMK file specifies both Y-Double AND Y-Interlace.\n", stderr);
+	if (fwrite(buf, 1, size, fp) != size) {
+		fprintf(stderr, "libsmacker::smk_save_index() - ERROR: could not write %s\n", filename);
+		perror("\tReason");
+		fclose(fp);
+		smk_free(buf);
+		return -1;
+	}
 
-		s->video.y_scale_mode = SMK_FLAG_Y_INTERLACE;
+	smk_free(buf);
+
+	if (fclose(fp)) {
+		fprintf(stderr, "libsmacker::smk_save_index() - ERROR: could not write %s\n", filename);
+		perror("\tReason");
+		return -1;
 	}
 
-	/* Max buffer size for each audio track - used to pre-allocate buffers */
-	for (temp_l = 0; temp_l < 7; temp_l ++)
-		smk_read_ul(s->audio[temp_l].max_buffer);
+	return 0;
+}
 
-	/* Read size of "hufftree chunk" - save for later. */
-	smk_read_ul(tree_size);
+/* read an entropy index from a sidecar file */
+char smk_load_index(smk object, const char * filename)
+{
+	struct smk_index_t x;
+	struct smk_mark_t * m;
+	/* the fixed header, then the rest of the file */
+	unsigned char header[SMK_INDEX_HEADER];
+	unsigned char * buf = NULL;
+	const unsigned char * b;
+	const unsigned long bh = (object ? (object->video.h + 3) >> 2 : 0);
+	unsigned long f, i, j, k, interval, marks, frames;
+	long size;
+	FILE * fp = NULL;
 
-	/* "unpacked" sizes of each huff tree */
-	for (temp_l = 0; temp_l < 4; temp_l ++)
-		smk_read_ul(s->video.tree_size[temp_l]);
+	/* null check */
+	if (object == NULL || filename == NULL) {
+		fputs("libsmacker::smk_load_index() - ERROR: smk or filename is NULL\n", stderr);
+		return -1;
+	}
 
-	/* read audio rate data */
-	for (temp_l = 0; temp_l < 7; temp_l ++) {
-		smk_read_ul(temp_u);
+	if (object->mode == SMK_MODE_INFO) {
+		fputs("libsmacker::smk_load_index() - ERROR: smk was opened with SMK_MODE_INFO\n", stderr);
+		return -1;
+	}
 
-		if (temp_u & 0x40000000) {
-			/* Audio track specifies "exists" flag, malloc structure and copy components. */
-			s->audio[temp_l].exists = 1;
-			/* and for all audio tracks */
-			smk_malloc(s->audio[temp_l].buffer, s->audio[temp_l].max_buffer);
+	memset(&x, 0, sizeof(x));
 
-			if (temp_u & 0x80000000)
-				s->audio[temp_l].compress = 1;
+	if ((fp = fopen(filename, "rb")) == NULL) {
+		fprintf(stderr, "libsmacker::smk_load_index() - ERROR: could not open %s\n", filename);
+		perror("\tReason");
+		return -1;
+	}
 
-			s->audio[temp_l].bitdepth = ((temp_u & 0x20000000) ? 16 : 8);
-			s->audio[temp_l].channels = ((temp_u & 0x10000000) ? 2 : 1);
+	if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < SMK_INDEX_HEADER || fseek(fp, 0, SEEK_SET)) {
+		fprintf(stderr, "libsmacker::smk_load_index() - ERROR: %s is not an index\n", filename);
+		goto error;
+	}
 
-			if (temp_u & 0x0c000000) {
-				fprintf(stderr, "libsmacker::smk_open_generic - Warning: audio track %ld is compressed with Bink (perceptual) Audio Codec: this is currently unsupported by libsmacker\n", temp_l);
-				s->audio[temp_l].compress = 2;
-			}
+	/* nothing is allocated until the header says how big the file should be */
+	if (fread(header, 1, SMK_INDEX_HEADER, fp) != SMK_INDEX_HEADER) {
+		fprintf(stderr, "libsmacker::smk_load_index() - ERROR: short read from %s\n", filename);
+		goto error;
+	}
 
-			/* Bits 25 & 24 are unused. */
-			s->audio[temp_l].rate = (temp_u & 0x00FFFFFF);
-		}
+	if (memcmp(header, SMK_INDEX_MAGIC, 4) || smk_index_get(header + 4, 4) != SMK_INDEX_VERSION) {
+		fprintf(stderr, "libsmacker::smk_load_index() - ERROR: %s is not an index (of this version)\n", filename);
+		goto error;
 	}
 
-	/* Skip over Dummy field */
-	smk_read_ul(temp_u);
-	/* FrameSizes and Keyframe marker are stored together. */
-	smk_malloc(s->keyframe, (s->f + s->ring_frame));
-	smk_malloc(s->chunk_size, (s->f + s->ring_frame) * sizeof(unsigned long));
+	/* it has to be for this file: these, and the video record hashes (checked as frames are decoded) */
+	frames = object->f + object->ring_frame;
+	interval = smk_index_get(header + 24, 4);
 
-	for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++) {
-		smk_read_ul(s->chunk_size[temp_u]);
+	if (smk_index_get(header + 8, 4) != frames ||
+		smk_index_get(header + 12, 4) != object->video.w ||
+		smk_index_get(header + 16, 4) != object->video.h ||
+		smk_index_get(header + 20, 4) != object->video.tree_hash ||
+		interval == 0) {
+		fprintf(stderr, "libsmacker::smk_load_index() - ERROR: %s is an index of a different file\n", filename);
+		goto error;
+	}
 
-		/* Set Keyframe */
-		if (s->chunk_size[temp_u] & 0x01)
-			s->keyframe[temp_u] = 1;
+	marks = (bh ? (bh - 1) / interval : 0);
 
-		/* Bits 1 is used, but the purpose is unknown. */
-		s->chunk_size[temp_u] &= 0xFFFFFFFC;
+	if ((unsigned long)size - SMK_INDEX_HEADER != frames * (5 + marks * SMK_INDEX_MARK)) {
+		fprintf(stderr, "libsmacker::smk_load_index() - ERROR: %s has the wrong size\n", filename);
+		goto error;
 	}
 
-	/* That was easy... Now read FrameTypes! */
-	smk_malloc(s->frame_type, (s->f + s->ring_frame));
+	/* (no smk_malloc: running out of memory here isn't fatal) */
+	if ((buf = malloc(size - SMK_INDEX_HEADER + 1)) == NULL) {
+		perror("libsmacker::smk_load_index() - ERROR: failed to malloc() index");
+		goto error;
+	}
 
-	for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++)
-		smk_read(&s->frame_type[temp_u], 1);
+	if (fread(buf, 1, size - SMK_INDEX_HEADER, fp) != (size_t)(size - SMK_INDEX_HEADER)) {
+		fprintf(stderr, "libsmacker::smk_load_index() - ERROR: short read from %s\n", filename);
+		goto error;
+	}
 
-	/* HuffmanTrees
-		We know the sizes already: read and assemble into
-		something actually parse-able at run-time */
-	smk_malloc(hufftree_chunk, tree_size);
-	smk_read(hufftree_chunk, tree_size);
-	/* set up a Bitstream */
-	smk_bs_init(&bs, hufftree_chunk, tree_size);
+	smk_index_alloc(&x, interval, frames, bh);
+	b = buf;
 
-	/* create some tables */
-	for (temp_u = 0; temp_u < 4; temp_u ++) {
-		if (! smk_huff16_build(&s->video.tree[temp_u], &bs, s->video.tree_size[temp_u])) {
-			fprintf(stderr, "libsmacker::smk_open_generic - ERROR: failed to create huff16 tree %lu\n", temp_u);
+	for (f = 0; f < x.frames; f ++, b += 5 + x.marks * SMK_INDEX_MARK) {
+		if (b[0] == 0)
+			continue;
+
+		if (b[0] != 1) {
+			fprintf(stderr, "libsmacker::smk_load_index() - ERROR: %s: frame %lu: bad entry\n", filename, f);
 			goto error;
 		}
-	}
 
-	/* clean up */
-	smk_free(hufftree_chunk);
-	/* Go ahead and malloc storage for the video frame */
-	smk_malloc(s->video.frame, s->video.w * s->video.h);
-	/* final processing: depending on ProcessMode, handle what to do with rest of file data */
-	s->mode = process_mode;
+		x.hash[f] = smk_index_get(b + 1, 4);
 
-	/* Handle the rest of the data.
-		For MODE_MEMORY, read the chunks and store */
-	if (s->mode == SMK_MODE_MEMORY) {
-		smk_malloc(s->source.chunk_data, (s->f + s->ring_frame) * sizeof(unsigned char *));
+		for (i = 0; i < x.marks; i ++) {
+			m = &x.mark[f * x.marks + i];
+			k = 5 + i * SMK_INDEX_MARK;
+			m->bit = smk_index_get(b + k, 4);
 
-		for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++) {
-			smk_malloc(s->source.chunk_data[temp_u], s->chunk_size[temp_u]);
-			smk_read(s->source.chunk_data[temp_u], s->chunk_size[temp_u]);
-		}
-	} else {
-		/* MODE_STREAM: don't read anything now, just precompute offsets.
-			use fseek to verify that the file is "complete" */
-		smk_malloc(s->source.file.chunk_offset, (s->f + s->ring_frame) * sizeof(unsigned long));
+			for (j = 0; j < 12; j ++)
+				m->cache[j / 3][j % 3] = (unsigned short)smk_index_get(b + k + 4 + j * 2, 2);
 
-		for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++) {
-			s->source.file.chunk_offset[temp_u] = ftell(fp.file);
+			m->left = (unsigned short)smk_index_get(b + k + 28, 2);
+			m->type = b[k + 30];
+			m->typedata = b[k + 31];
 
-			if (fseek(fp.file, s->chunk_size[temp_u], SEEK_CUR)) {
-				fprintf(stderr, "libsmacker::smk_open - ERROR: fseek to frame %lu not OK.\n", temp_u);
-				perror("\tError reported was");
+			/* (anything else can only decode to wrong pixels, but these
+				would make commands the reconstruction can't follow) */
+			if (m->type > 5 || m->left == 0) {
+				fprintf(stderr, "libsmacker::smk_load_index() - ERROR: %s: frame %lu: bad checkpoint\n", filename, f);
 				goto error;
 			}
 		}
+
+		x.state[f] = SMK_INDEX_LOADED;
+		x.indexed ++;
 	}
 
-	return s;
+	fclose(fp);
+	smk_free(buf);
+	/* replace the index there was */
+	smk_index_sync(object);
+	x.sliced = object->video.index.sliced;
+	smk_index_free(&object->video.index);
+	object->video.index = x;
+	return 0;
 error:
-	smk_free(hufftree_chunk);
-	smk_close(s);
-	return NULL;
+	fclose(fp);
+
+	if (buf)
+		smk_free(buf);
+
+	smk_index_free(&x);
+	return -1;
 }
 
-/* open an smk (from a memory buffer) */
-smk smk_open_memory(const unsigned char * buffer, const unsigned long size)
+/* open a chunk fetch queue */
+smk_fetch smk_fetch_open(const unsigned int depth)
 {
-	smk s = NULL;
-	union smk_read_t fp;
+	struct smk_fetch_t * q;
 
-	if (buffer == NULL) {
-		fputs("libsmacker::smk_open_memory() - ERROR: buffer pointer is NULL\n", stderr);
+	if (depth == 0) {
+		fputs("libsmacker::smk_fetch_open() - ERROR: depth is 0\n", stderr);
 		return NULL;
 	}
 
-	/* set up the read union for Memory mode */
-	fp.ram = (unsigned char *)buffer;
-
-	if (!(s = smk_open_generic(0, fp, size, SMK_MODE_MEMORY)))
-		fprintf(stderr, "libsmacker::smk_open_memory(buffer,%lu) - ERROR: Fatal error in smk_open_generic, returning NULL.\n", size);
+	if ((q = calloc(1, sizeof(struct smk_fetch_t))) == NULL) {
+		perror("libsmacker::smk_fetch_open() - ERROR: failed to malloc() fetch queue");
+		return NULL;
+	}
 
-	return s;
+	q->depth = depth;
+	smk_malloc(q->done, depth * sizeof(smk));
+#ifdef SMK_HAVE_IO_URING
+	/* (no ring: reads just happen on submit) */
+	q->fd = -1;
+	smk_fetch_ring(q);
+#endif
+	return q;
 }
 
-/* open an smk (from a file) */
-smk smk_open_filepointer(FILE * file, const unsigned char mode)
+/* close a chunk fetch queue */
+void smk_fetch_close(smk_fetch q)
 {
-	smk s = NULL;
-	union smk_read_t fp;
+	unsigned int i;
 
-	if (file == NULL) {
-		fputs("libsmacker::smk_open_filepointer() - ERROR: file pointer is NULL\n", stderr);
-		return NULL;
+	if (q == NULL) {
+		fputs("libsmacker::smk_fetch_close() - ERROR: fetch queue is NULL\n", stderr);
+		return;
 	}
 
-	/* Copy file ptr to internal union */
-	fp.file = file;
+#ifdef SMK_HAVE_IO_URING
 
-	if (!(s = smk_open_generic(1, fp, 0, mode))) {
-		fprintf(stderr, "libsmacker::smk_open_filepointer(file,%u) - ERROR: Fatal error in smk_open_generic, returning NULL.\n", mode);
-		fclose(fp.file);
-		goto error;
-	}
+	/* let reads land before the buffers they go to can be freed */
+	while (q->in_flight > 0 && smk_fetch_reap(q) == 0);
 
-	if (mode == SMK_MODE_MEMORY)
-		fclose(fp.file);
-	else
-		s->source.file.fp = fp.file;
+	smk_fetch_unring(q);
+#endif
 
-	/* fall through, return s or null */
-error:
-	return s;
+	/* reads never collected: forget the queue */
+	for (i = 0; i < q->done_count; i ++)
+		q->done[(q->done_head + i) % q->depth]->source.file.fetch = NULL;
+
+	smk_free(q->done);
+	smk_free(q);
 }
 
-/* open an smk (from a file) */
-smk smk_open_file(const char * filename, const unsigned char mode)
+/* start reading the chunk for a frame */
+char smk_fetch_submit(smk_fetch q, smk object, const unsigned long frame)
 {
-	FILE * fp;
-
-	if (filename == NULL) {
-		fputs("libsmacker::smk_open_file() - ERROR: filename is NULL\n", stderr);
-		return NULL;
+	/* null check */
+	if (q == NULL || object == NULL) {
+		fputs("libsmacker::smk_fetch_submit() - ERROR: fetch queue or smk is NULL\n", stderr);
+		return -1;
 	}
 
-	if (!(fp = fopen(filename, "rb"))) {
-		fprintf(stderr, "libsmacker::smk_open_file(%s,%u) - ERROR: could not open file\n", filename, mode);
-		perror("\tError reported was");
-		goto error;
+	if (object->mode != SMK_MODE_DISK) {
+		fputs("libsmacker::smk_fetch_submit() - ERROR: fetching needs SMK_MODE_DISK\n", stderr);
+		return -1;
 	}
 
-	/* kick processing to smk_open_filepointer */
-	return smk_open_filepointer(fp, mode);
-	/* fall through, return s or null */
-error:
-	return NULL;
-}
-
-/* close out an smk file and clean up memory */
-void smk_close(smk s)
-{
-	unsigned long u;
+	if (frame >= object->f + object->ring_frame) {
+		fprintf(stderr, "libsmacker::smk_fetch_submit(q,s,%lu) - ERROR: no such frame\n", frame);
+		return -1;
+	}
 
-	if (s == NULL) {
-		fputs("libsmacker::smk_close() - ERROR: smk is NULL\n", stderr);
-		return;
+	if (object->source.file.fetch) {
+		fputs("libsmacker::smk_fetch_submit() - ERROR: smk already has a read queued\n", stderr);
+		return -1;
 	}
 
-	/* free video sub-components */
-	for (u = 0; u < 4; u ++) {
-		if (s->video.tree[u].tree) free(s->video.tree[u].tree);
+	if (q->in_flight + q->done_count >= q->depth) {
+		fputs("libsmacker::smk_fetch_submit() - ERROR: fetch queue is full\n", stderr);
+		return -1;
 	}
 
-	smk_free(s->video.frame);
+	if (object->source.file.fetch_buffer == NULL)
+		smk_malloc(object->source.file.fetch_buffer, object->source.file.buffer_size);
 
-	/* free audio sub-components */
-	for (u = 0; u < 7; u++) {
-		if (s->audio[u].buffer)
-			smk_free(s->audio[u].buffer);
+	object->source.file.fetch = q;
+	object->source.file.fetch_frame = frame;
+	object->source.file.fetch_state = SMK_FETCH_READING;
+#ifdef SMK_HAVE_IO_URING
+
+	if (q->fd >= 0 && smk_io_fd(object) >= 0 && smk_fetch_ring_submit(q, object) == 0)
+		return 0;
+
+#endif
+	smk_fetch_finish(q, object, -1);
+	return 0;
+}
+
+/* wait for a read to finish */
+smk smk_fetch_wait(smk_fetch q, unsigned long * frame)
+{
+	smk s;
+
+	/* null check */
+	if (q == NULL) {
+		fputs("libsmacker::smk_fetch_wait() - ERROR: fetch queue is NULL\n", stderr);
+		return NULL;
 	}
 
-	smk_free(s->keyframe);
-	smk_free(s->frame_type);
+	if (q->done_count == 0) {
+		if (q->in_flight == 0)
+			return NULL;
 
-	if (s->mode == SMK_MODE_DISK) {
-		/* disk-mode */
-		if (s->source.file.fp)
-			fclose(s->source.file.fp);
+#ifdef SMK_HAVE_IO_URING
 
-		smk_free(s->source.file.chunk_offset);
-	} else {
-		/* mem-mode */
-		if (s->source.chunk_data != NULL) {
-			for (u = 0; u < (s->f + s->ring_frame); u++)
-				smk_free(s->source.chunk_data[u]);
+		if (smk_fetch_reap(q) < 0)
+			return NULL;
 
-			smk_free(s->source.chunk_data);
-		}
+#endif
 	}
 
-	smk_free(s->chunk_size);
-	smk_free(s);
+	s = q->done[q->done_head];
+	q->done_head = (q->done_head + 1) % q->depth;
+	q->done_count --;
+	s->source.file.fetch = NULL;
+
+	if (frame)
+		*frame = s->source.file.fetch_frame;
+
+	return s;
 }
 
-/* tell some info about the file */
-char smk_info_all(const smk object, unsigned long * frame, unsigned long * frame_count, double * usf)
+/* read-ahead hit/miss counts */
+char smk_get_readahead_stats(const smk object, unsigned long * hits, unsigned long * misses)
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_info_all() - ERROR: smk is NULL\n", stderr);
+		fputs("libsmacker::smk_get_readahead_stats() - ERROR: smk is NULL\n", stderr);
 		return -1;
 	}
 
-	if (!frame && !frame_count && !usf) {
-		fputs("libsmacker::smk_info_all(object,frame,frame_count,usf) - ERROR: Request for info with all-NULL return references\n", stderr);
-		goto error;
-	}
+	if (hits)
+		*hits = 0;
 
-	if (frame)
-		*frame = (object->cur_frame % object->f);
+	if (misses)
+		*misses = 0;
 
-	if (frame_count)
-		*frame_count = object->f;
+#ifdef SMK_HAVE_THREADS
 
-	if (usf)
-		*usf = object->usf;
+	if (object->mode == SMK_MODE_DISK && object->source.file.ra) {
+		pthread_mutex_lock(&object->source.file.ra->lock);
+
+		if (hits)
+			*hits = object->source.file.ra->hits;
 
+		if (misses)
+			*misses = object->source.file.ra->misses;
+
+		pthread_mutex_unlock(&object->source.file.ra->lock);
+	}
+
+#endif
 	return 0;
-error:
-	return -1;
 }
 
-char smk_info_video(const smk object, unsigned long * w, unsigned long * h, unsigned char * y_scale_mode)
+const unsigned char * smk_get_palette(const smk object)
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_info_video() - ERROR: smk is NULL\n", stderr);
-		return -1;
+		fputs("libsmacker::smk_get_palette() - ERROR: smk is NULL\n", stderr);
+		return NULL;
 	}
 
-	if (!w && !h && !y_scale_mode) {
-		fputs("libsmacker::smk_info_all(object,w,h,y_scale_mode) - ERROR: Request for info with all-NULL return references\n", stderr);
-		return -1;
+	return (unsigned char *)object->video.palette;
+}
+const unsigned char * smk_get_video(const smk object)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_get_video() - ERROR: smk is NULL\n", stderr);
+		return NULL;
 	}
 
-	if (w)
-		*w = object->video.w;
-
-	if (h)
-		*h = object->video.h;
+	return object->video.target;
+}
 
-	if (y_scale_mode)
-		*y_scale_mode = object->video.y_scale_mode;
+/* row pitch of the video frame */
+unsigned long smk_get_video_stride(const smk object)
+{
+	/* null check */
+	if (object == NULL) {
+		fputs("libsmacker::smk_get_video_stride() - ERROR: smk is NULL\n", stderr);
+		return 0;
+	}
 
-	return 0;
+	return object->video.stride;
 }
 
-char smk_info_audio(const smk object, unsigned char * track_mask, unsigned char channels[7], unsigned char bitdepth[7], unsigned long audio_rate[7])
+/* decode into a caller-owned buffer */
+char smk_set_video_target(smk object, unsigned char * buffer, const unsigned long stride)
 {
-	unsigned char i;
-
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_info_audio() - ERROR: smk is NULL\n", stderr);
+		fputs("libsmacker::smk_set_video_target() - ERROR: smk is NULL\n", stderr);
 		return -1;
 	}
 
-	if (!track_mask && !channels && !bitdepth && !audio_rate) {
-		fputs("libsmacker::smk_info_audio(object,track_mask,channels,bitdepth,audio_rate) - ERROR: Request for info with all-NULL return references\n", stderr);
+	if (object->mode == SMK_MODE_INFO) {
+		fputs("libsmacker::smk_set_video_target() - ERROR: smk was opened with SMK_MODE_INFO\n", stderr);
 		return -1;
 	}
 
-	if (track_mask) {
-		*track_mask = ((object->audio[0].exists) |
-				((object->audio[1].exists) << 1) |
-				((object->audio[2].exists) << 2) |
-				((object->audio[3].exists) << 3) |
-				((object->audio[4].exists) << 4) |
-				((object->audio[5].exists) << 5) |
-				((object->audio[6].exists) << 6));
-	}
-
-	if (channels) {
-		for (i = 0; i < 7; i ++)
-			channels[i] = object->audio[i].channels;
-	}
-
-	if (bitdepth) {
-		for (i = 0; i < 7; i ++)
-			bitdepth[i] = object->audio[i].bitdepth;
-	}
-
-	if (audio_rate) {
-		for (i = 0; i < 7; i ++)
-			audio_rate[i] = object->audio[i].rate;
-	}
-
-	return 0;
+	return smk_video_output(&object->video, buffer, stride, object->video.format | (object->video.colorkey ? SMK_VIDEO_COLORKEY : 0));
 }
 
-/* Enable-disable switches */
-char smk_enable_all(smk object, const unsigned char mask)
+/* choose the pixel format of decoded video */
+char smk_set_video_format(smk object, const unsigned char format)
 {
-	unsigned char i;
-
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_enable_all() - ERROR: smk is NULL\n", stderr);
+		fputs("libsmacker::smk_set_video_format() - ERROR: smk is NULL\n", stderr);
 		return -1;
 	}
 
-	/* set video-enable */
-	object->video.enable = (mask & 0x80);
-
-	for (i = 0; i < 7; i ++) {
-		if (object->audio[i].exists)
-			object->audio[i].enable = (mask & (1 << i));
+	if (object->mode == SMK_MODE_INFO) {
+		fputs("libsmacker::smk_set_video_format() - ERROR: smk was opened with SMK_MODE_INFO\n", stderr);
+		return -1;
 	}
 
-	return 0;
+	return smk_video_output(&object->video, object->video.user_target, object->video.user_stride, format);
 }
 
-char smk_enable_video(smk object, const unsigned char enable)
+const unsigned char * smk_get_palette_rgba(const smk object)
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_enable_video() - ERROR: smk is NULL\n", stderr);
-		return -1;
+		fputs("libsmacker::smk_get_palette_rgba() - ERROR: smk is NULL\n", stderr);
+		return NULL;
 	}
 
-	object->video.enable = enable;
-	return 0;
+	return (unsigned char *)object->video.palette_rgba;
 }
 
-char smk_enable_audio(smk object, const unsigned char track, const unsigned char enable)
+/* did the current frame carry a palette record */
+char smk_get_palette_changed(const smk object)
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_enable_audio() - ERROR: smk is NULL\n", stderr);
+		fputs("libsmacker::smk_get_palette_changed() - ERROR: smk is NULL\n", stderr);
 		return -1;
 	}
 
-	object->audio[track].enable = enable;
-	return 0;
+	return (object->frame_type[object->cur_frame] & 0x01);
 }
 
-const unsigned char * smk_get_palette(const smk object)
+const unsigned char * smk_get_video_dirty(const smk object)
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_get_palette() - ERROR: smk is NULL\n", stderr);
+		fputs("libsmacker::smk_get_video_dirty() - ERROR: smk is NULL\n", stderr);
 		return NULL;
 	}
 
-	return (unsigned char *)object->video.palette;
+	return object->video.dirty;
 }
-const unsigned char * smk_get_video(const smk object)
+
+unsigned long smk_get_video_dirty_rects(const smk object, const unsigned long ** rect)
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_get_video() - ERROR: smk is NULL\n", stderr);
-		return NULL;
+		fputs("libsmacker::smk_get_video_dirty_rects() - ERROR: smk is NULL\n", stderr);
+		return 0;
 	}
 
-	return object->video.frame;
+	/* (nothing to build for SMK_MODE_INFO) */
+	if (object->video.dirty && ! object->video.dirty_rect_valid)
+		smk_dirty_rects(&object->video);
+
+	if (rect)
+		*rect = object->video.dirty_rect;
+
+	return object->video.dirty_rect_count;
 }
 const unsigned char * smk_get_audio(const smk object, const unsigned char t)
 {
@@ -1163,6 +4535,19 @@ unsigned long smk_get_audio_size(const smk object, const unsigned char t)
 	return object->audio[t].buffer_size;
 }
 
+/* Repack the palette entries that differ from "old" */
+static void smk_palette_update(struct smk_video_t * s, unsigned char old[256][3])
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; i ++) {
+		if (memcmp(s->palette[i], old[i], 3)) {
+			smk_palette_pack(s, i);
+			s->palette_changed = 1;
+		}
+	}
+}
+
 /* Decompresses a palette-frame. */
 static char smk_render_palette(struct smk_video_t * s, unsigned char * p, unsigned long size)
 {
@@ -1170,7 +4555,8 @@ static char smk_render_palette(struct smk_video_t * s, unsigned char * p, unsign
 	unsigned short i = 0;
 	/* Helper variables */
 	unsigned short count, src;
-	static unsigned char oldPalette[256][3];
+	/* (on the stack, not static: smk on different threads don't share it) */
+	unsigned char oldPalette[256][3];
 	/* Smacker palette map: smk colors are 6-bit, this table expands them to 8. */
 	const unsigned char palmap[64] = {
 		0x00, 0x04, 0x08, 0x0C, 0x10, 0x14, 0x18, 0x1C,
@@ -1262,27 +4648,58 @@ static char smk_render_palette(struct smk_video_t * s, unsigned char * p, unsign
 		goto error;
 	}
 
+	smk_palette_update(s, oldPalette);
 	return 0;
 error:
 	/* Error, return -1
 		The new palette probably has errors but is preferrable to a black screen */
+	smk_palette_update(s, oldPalette);
 	return -1;
 }
 
-static char smk_render_video(struct smk_video_t * s, unsigned char * p, unsigned int size)
+/* Entropy stage, for block rows r0 to r1: walk that part of a frame's
+	video bitstream through the four trees into block commands (see
+	struct smk_cmds_t), row r's from r * bw * 10 shorts on. Uses nothing
+	but the trees, so it can run ahead of the frame's reconstruction.
+	Starts from the beginning of the record (r0 0, "from" NULL), or from
+	the checkpoint taken at row r0. With "mark" set, takes a checkpoint
+	for every index interval's worth of rows.
+	*len gets the end of the commands, *rows one past the last row begun.
+	Returns -1 if the bitstream failed: the commands end with the last
+	block finished. */
+#define smk_entropy_lookup(which, name, dst) \
+{ \
+	if ((unpack = smk_huff16_lookup(&tree[which], &bs)) < 0) \
+	{ \
+		fputs("libsmacker::smk_video_slice() - ERROR: failed to lookup from " name " tree.\n", stderr); \
+		goto error; \
+	} \
+	dst = unpack; \
+}
+
+static char smk_video_slice(const struct smk_video_t * s, struct smk_cmds_t * c, const unsigned char * p, const unsigned long size, const unsigned long r0, const unsigned long r1, const struct smk_mark_t * from, struct smk_mark_t * mark, unsigned long * len, unsigned long * rows)
 {
-	unsigned char * t = s->frame;
-	unsigned char s1, s2;
-	unsigned short temp;
-	unsigned long i, j, k, row, col, skip;
-	/* used for video decoding */
+	const unsigned long bw = (s->w + 3) >> 2;
+	/* command being written, the block count of its run, the block's data */
+	unsigned short * o = c->cmd + r0 * bw * 10, * run = NULL, * blk = o;
+	unsigned long i, k;
+	/* blocks decoded, of "total", column within the block row,
+		and the row after the last one begun */
+	unsigned long blocks = r0 * bw, col = 0, row = r0;
+	const unsigned long total = bw * r1;
+	/* blocks left in the current run */
+	unsigned long n = 0;
+	/* checkpoint being taken */
+	struct smk_mark_t * m;
+	/* used for video decoding: the bitstream, and trees with caches of their own */
 	struct smk_bit_t bs;
+	struct smk_huff16_t tree[4];
 	/* results from a tree lookup */
 	int unpack;
 	/* unpack, broken into pieces */
-	unsigned char type;
+	unsigned char type = 0;
 	unsigned char blocklen;
-	unsigned char typedata;
+	unsigned char typedata = 0;
 	char bit;
 	const unsigned short sizetable[64] = {
 		1,	 2,	3,	4,	5,	6,	7,	8,
@@ -1297,179 +4714,386 @@ static char smk_render_video(struct smk_video_t * s, unsigned char * p, unsigned
 	/* null check */
 	assert(s);
 	assert(p);
-	row = 0;
-	col = 0;
-	/* Set up a bitstream for video unpacking */
-	smk_bs_init(&bs, p, size);
 
-	/* Reset the cache on all bigtrees */
 	for (i = 0; i < 4; i++)
-		memset(&s->tree[i].cache, 0, 3 * sizeof(unsigned short));
+		tree[i] = s->tree[i];
 
-	while (row < s->h) {
-		if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_TYPE], &bs)) < 0) {
-			fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from TYPE tree.\n", stderr);
-			return -1;
+	if (from) {
+		/* pick up where the checkpoint left off */
+		smk_bs_init(&bs, p + (from->bit >> 3), size - (from->bit >> 3));
+
+		if (from->bit & 7) {
+			smk_bs_fill(&bs, from->bit & 7);
+			smk_bs_consume(&bs, from->bit & 7);
 		}
 
-		type = ((unpack & 0x0003));
-		blocklen = ((unpack & 0x00FC) >> 2);
-		typedata = ((unpack & 0xFF00) >> 8);
+		for (i = 0; i < 4; i++)
+			memcpy(tree[i].cache, from->cache[i], 3 * sizeof(unsigned short));
+
+		n = from->left;
+		type = from->type;
+		typedata = from->typedata;
+	} else {
+		/* Set up a bitstream for video unpacking, and reset the cache on all bigtrees */
+		smk_bs_init(&bs, p, size);
+
+		for (i = 0; i < 4; i++)
+			memset(tree[i].cache, 0, 3 * sizeof(unsigned short));
+	}
+
+	while (blocks < total) {
+		if (n == 0) {
+			blk = o;
+
+			if ((unpack = smk_huff16_lookup(&tree[SMK_TREE_TYPE], &bs)) < 0) {
+				fputs("libsmacker::smk_video_slice() - ERROR: failed to lookup from TYPE tree.\n", stderr);
+				goto error;
+			}
 
-		/* support for v4 full-blocks */
-		if (type == 1 && s->v == '4') {
-			bit = smk_bs_read_1(&bs);
+			type = ((unpack & 0x0003));
+			blocklen = ((unpack & 0x00FC) >> 2);
+			typedata = ((unpack & 0xFF00) >> 8);
 
-			if (bit)
-				type = 4;
-			else {
+			/* support for v4 full-blocks */
+			if (type == 1 && s->v == '4') {
 				bit = smk_bs_read_1(&bs);
 
 				if (bit)
-					type = 5;
+					type = 4;
+				else {
+					bit = smk_bs_read_1(&bs);
+
+					if (bit)
+						type = 5;
+				}
 			}
+
+			n = sizetable[blocklen];
 		}
 
-		for (j = 0; (j < sizetable[blocklen]) && (row < s->h); j ++) {
-			skip = (row * s->w) + col;
+		/* (runs past the last block are cut short) */
+		if (n > total - blocks)
+			n = total - blocks;
 
-			switch (type) {
-			case 0:
-				if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_MCLR], &bs)) < 0) {
-					fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from MCLR tree.\n", stderr);
-					return -1;
+		/* one command per block row the run touches */
+		while (n > 0) {
+			k = (n < bw - col ? n : bw - col);
+
+			if (col == 0) {
+				/* checkpoint: the state before the row's first command */
+				if (mark && row > 0 && row % s->index.interval == 0) {
+					m = &mark[row / s->index.interval - 1];
+					m->bit = (unsigned long)(bs.buffer - p) * 8 - bs.count;
+
+					for (i = 0; i < 4; i++)
+						memcpy(m->cache[i], tree[i].cache, 3 * sizeof(unsigned short));
+
+					m->left = (unsigned short)n;
+					m->type = type;
+					m->typedata = typedata;
 				}
 
-				s1 = (unpack & 0xFF00) >> 8;
-				s2 = (unpack & 0x00FF);
+				c->row[row ++] = (unsigned long)(o - c->cmd);
+			}
+
+			*(o ++) = type | (typedata << 8);
+			run = o ++;
 
-				if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_MMAP], &bs)) < 0) {
-					fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from MMAP tree.\n", stderr);
-					return -1;
+			/* Each type gets its own loop, so there is no per-block dispatch.
+				*run counts the blocks completed, should a lookup fail. */
+			switch (type) {
+			case 0: /* MONO BLOCK: colors, then map */
+				for (*run = 0; *run < k; (*run) ++) {
+					blk = o;
+					smk_entropy_lookup(SMK_TREE_MCLR, "MCLR", o[0]);
+					smk_entropy_lookup(SMK_TREE_MMAP, "MMAP", o[1]);
+					o += 2;
 				}
 
-				temp = 0x01;
+				break;
 
-				for (k = 0; k < 4; k ++) {
-					for (i = 0; i < 4; i ++) {
-						if (unpack & temp)
-							t[skip + i] = s1;
-						else
-							t[skip + i] = s2;
+			case 1: /* FULL BLOCK */
+				for (*run = 0; *run < k; (*run) ++) {
+					blk = o;
 
-						temp = temp << 1;
+					/* each row comes as the right-hand pair, then the left-hand pair */
+					for (i = 0; i < 8; i += 2) {
+						smk_entropy_lookup(SMK_TREE_FULL, "FULL", o[i + 1]);
+						smk_entropy_lookup(SMK_TREE_FULL, "FULL", o[i]);
 					}
 
-					skip += s->w;
+					o += 8;
 				}
 
 				break;
 
-			case 1: /* FULL BLOCK */
-				for (k = 0; k < 4; k ++) {
-					if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_FULL], &bs)) < 0) {
-						fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.\n", stderr);
-						return -1;
-					}
+			case 4: /* V4 DOUBLE BLOCK */
+				for (*run = 0; *run < k; (*run) ++) {
+					blk = o;
+					smk_entropy_lookup(SMK_TREE_FULL, "FULL", o[0]);
+					smk_entropy_lookup(SMK_TREE_FULL, "FULL", o[1]);
+					o += 2;
+				}
+
+				break;
 
-					t[skip + 3] = ((unpack & 0xFF00) >> 8);
-					t[skip + 2] = (unpack & 0x00FF);
+			case 5: /* V4 HALF BLOCK */
+				for (*run = 0; *run < k; (*run) ++) {
+					blk = o;
 
-					if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_FULL], &bs)) < 0) {
-						fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.\n", stderr);
-						return -1;
+					for (i = 0; i < 4; i += 2) {
+						smk_entropy_lookup(SMK_TREE_FULL, "FULL", o[i + 1]);
+						smk_entropy_lookup(SMK_TREE_FULL, "FULL", o[i]);
 					}
 
-					t[skip + 1] = ((unpack & 0xFF00) >> 8);
-					t[skip] = (unpack & 0x00FF);
-					skip += s->w;
+					o += 4;
 				}
 
 				break;
 
-			case 2: /* VOID BLOCK */
-				/* break;
-				if (s->frame)
-				{
-					memcpy(&t[skip], &s->frame[skip], 4);
-					skip += s->w;
-					memcpy(&t[skip], &s->frame[skip], 4);
-					skip += s->w;
-					memcpy(&t[skip], &s->frame[skip], 4);
-					skip += s->w;
-					memcpy(&t[skip], &s->frame[skip], 4);
-				} */
+			default: /* VOID and SOLID BLOCK: nothing per block */
+				*run = k;
 				break;
+			}
+
+			n -= k;
+			blocks += k;
+			col += k;
+
+			if (col == bw)
+				col = 0;
+		}
+	}
+
+	*len = (unsigned long)(o - c->cmd);
+	*rows = row;
+	return 0;
+error:
+	/* keep the blocks finished before the failure */
+	*len = (unsigned long)(blk - c->cmd);
+	*rows = row;
+	return -1;
+}
+
+/* Check a frame's checkpoints from a sidecar file against its video record */
+static void smk_index_check(struct smk_index_t * x, const unsigned long f, const unsigned char * p, const unsigned long size)
+{
+	const struct smk_mark_t * mark = x->mark + f * x->marks;
+	unsigned long i;
+
+	x->state[f] = SMK_INDEX_NONE;
+
+	if (smk_hash(p, size) != x->hash[f]) {
+		fprintf(stderr, "libsmacker::smk_index_check() - ERROR: frame %lu: video record does not match the index, indexing it again\n", f);
+		x->indexed --;
+		return;
+	}
+
+	for (i = 0; i < x->marks; i ++) {
+		if (mark[i].bit > size * 8) {
+			fprintf(stderr, "libsmacker::smk_index_check() - ERROR: frame %lu: checkpoint past the end of the video record, indexing it again\n", f);
+			x->indexed --;
+			return;
+		}
+	}
+
+	x->state[f] = SMK_INDEX_RECORDED;
+}
+
+/* Entropy stage for frame f: in slices on "pool" (if any), if it is indexed,
+	or all in one go (indexing it, if the index is on and it isn't yet) */
+static void smk_video_entropy(struct smk_video_t * s, struct smk_cmds_t * c, struct smk_pool_t * pool, const unsigned long f, const unsigned char * p, const unsigned long size)
+{
+	struct smk_index_t * const x = &s->index;
+	struct smk_mark_t * mark = NULL;
+#ifdef SMK_HAVE_THREADS
+	struct smk_pool_job_t job;
+#endif
+	/* null check */
+	assert(s);
+	assert(p);
+#ifndef SMK_HAVE_THREADS
+	(void)pool;
+#endif
+	c->failed = 0;
+
+	if (x->interval) {
+		if (x->state[f] == SMK_INDEX_LOADED)
+			smk_index_check(x, f, p, size);
+
+#ifdef SMK_HAVE_THREADS
+
+		if (x->state[f] == SMK_INDEX_RECORDED && x->marks && pool) {
+			job.work = smk_pool_slice;
+			job.video = s;
+			job.cmds = c;
+			job.p = p;
+			job.size = size;
+			job.mark = x->mark + f * x->marks;
+			job.rows = (s->h + 3) >> 2;
+			job.band = x->interval;
+
+			if (smk_pool_run(pool, &job) == 0) {
+				c->len = job.len;
+				c->rows = job.rows;
+				x->sliced ++;
+				return;
+			}
+
+			/* (a slice failed: decode it all again, to fail at the same place) */
+		}
+
+#endif
+
+		if (x->state[f] == SMK_INDEX_NONE)
+			mark = x->mark + f * x->marks;
+	}
+
+	if (smk_video_slice(s, c, p, size, 0, (s->h + 3) >> 2, NULL, mark, &c->len, &c->rows) < 0)
+		c->failed = 1;
+	else if (mark) {
+		x->state[f] = SMK_INDEX_RECORDED;
+		x->hash[f] = smk_hash(p, size);
+		x->indexed ++;
+	}
+}
+
+/* Reconstruction stage, for block rows r0 to r1: apply their block
+	commands to the frame (and convert to the output format, for a color
+	one). With "convert" set, every pixel row is converted afterwards. */
+static void smk_video_rows(struct smk_video_t * s, const struct smk_cmds_t * c, const unsigned long r0, const unsigned long r1, const unsigned char convert)
+{
+	/* indexed frame being decoded: the output itself, or "frame" if
+		blocks are converted to color as they're written */
+	unsigned char * const frame = (s->format == SMK_VIDEO_INDEXED ? s->target : s->frame);
+	const unsigned long istride = (s->format == SMK_VIDEO_INDEXED ? s->stride : s->pitch);
+	unsigned char * t;
+	/* changed-block map entry for the block at t */
+	unsigned char * d;
+	/* convert block by block? (after a palette change, the whole frame
+		needs converting anyway, so that is done once at the end) */
+	const unsigned char fused = (s->format != SMK_VIDEO_INDEXED && !s->palette_changed);
+	const unsigned short * o, * end;
+	unsigned long k, n;
+	/* position, and frame width, in blocks */
+	unsigned long row, col;
+	const unsigned long bw = (s->w + 3) >> 2;
+	unsigned char type;
+
+	for (row = r0; row < r1; row ++) {
+		d = s->dirty + row * bw;
+		col = 0;
+
+		if (row < c->rows) {
+			o = c->cmd + c->row[row];
+			end = c->cmd + (row + 1 < c->rows ? c->row[row + 1] : c->len);
+		} else
+			o = end = NULL;
+
+		/* (rows decoded in slices may have unused space before the next) */
+		while (col < bw && o < end) {
+			type = (o[0] & 0xFF);
+			n = o[1];
+			t = frame + row * (istride << 2) + (col << 2);
+
+			switch (type) {
+			case 0: /* MONO BLOCK */
+				for (k = 0, o += 2; k < n; k ++, o += 2)
+					s->blocks->mono(t + (k << 2), istride, o[0] >> 8, o[0] & 0xFF, o[1]);
 
-			case 3: /* SOLID BLOCK */
-				memset(&t[skip], typedata, 4);
-				skip += s->w;
-				memset(&t[skip], typedata, 4);
-				skip += s->w;
-				memset(&t[skip], typedata, 4);
-				skip += s->w;
-				memset(&t[skip], typedata, 4);
 				break;
 
-			case 4: /* V4 DOUBLE BLOCK */
-				for (k = 0; k < 2; k ++) {
-					if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_FULL], &bs)) < 0) {
-						fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.\n", stderr);
-						return -1;
-					}
+			case 1: /* FULL BLOCK */
+				for (k = 0, o += 2; k < n; k ++, o += 8)
+					s->blocks->full(t + (k << 2), istride, o);
 
-					for (i = 0; i < 2; i ++) {
-						memset(&t[skip + 2], (unpack & 0xFF00) >> 8, 2);
-						memset(&t[skip], (unpack & 0x00FF), 2);
-						skip += s->w;
-					}
-				}
+				break;
 
+			case 2: /* VOID BLOCK: keep the previous frame's pixels */
+				o += 2;
 				break;
 
-			case 5: /* V4 HALF BLOCK */
-				for (k = 0; k < 2; k ++) {
-					if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_FULL], &bs)) < 0) {
-						fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.\n", stderr);
-						return -1;
-					}
+			case 3: /* SOLID BLOCK */
+				s->blocks->solid(t, istride, o[0] >> 8, n);
+				o += 2;
+				break;
 
-					t[skip + 3] = ((unpack & 0xFF00) >> 8);
-					t[skip + 2] = (unpack & 0x00FF);
-					t[skip + s->w + 3] = ((unpack & 0xFF00) >> 8);
-					t[skip + s->w + 2] = (unpack & 0x00FF);
+			case 4: /* V4 DOUBLE BLOCK */
+				for (k = 0, o += 2; k < n; k ++, o += 2)
+					s->blocks->dbl(t + (k << 2), istride, o);
 
-					if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_FULL], &bs)) < 0) {
-						fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.\n", stderr);
-						return -1;
-					}
+				break;
 
-					t[skip + 1] = ((unpack & 0xFF00) >> 8);
-					t[skip] = (unpack & 0x00FF);
-					t[skip + s->w + 1] = ((unpack & 0xFF00) >> 8);
-					t[skip + s->w] = (unpack & 0x00FF);
-					skip += (s->w << 1);
-				}
+			case 5: /* V4 HALF BLOCK */
+				for (k = 0, o += 2; k < n; k ++, o += 4)
+					s->blocks->half(t + (k << 2), istride, o);
 
 				break;
 			}
 
-			col += 4;
+			memset(d, (type != 2), n);
+			d += n;
 
-			if (col >= s->w) {
-				col = 0;
-				row += 4;
-			}
+			if (fused && type != 2)
+				s->convert(t, istride, s->target + row * (s->stride << 2) + col * (s->bpp << 2), s->stride, s->palette_packed, n << 2, 4);
+
+			col += n;
 		}
+
+		/* (short only after a failure) blocks from there on were left as they were */
+		memset(d, 0, bw - col);
+	}
+
+	if (convert) {
+		/* new colors: every pixel needs converting, changed or not */
+		row = r0 << 2;
+		n = (r1 << 2 < s->h ? r1 << 2 : s->h);
+
+		if (n > row)
+			s->convert(s->frame + row * s->pitch, s->pitch, s->target + row * s->stride, s->stride, s->palette_packed, s->w, n - row);
 	}
+}
+
+/* Reconstruction stage: apply a frame's block commands, on the pool if
+	there is one, or here */
+static char smk_video_reconstruct(struct smk_video_t * s, struct smk_cmds_t * c)
+{
+	const unsigned long bh = (s->h + 3) >> 2;
+	/* after a palette change, convert the whole frame (unless it failed) */
+	const unsigned char convert = (s->format != SMK_VIDEO_INDEXED && s->palette_changed && !c->failed);
+#ifdef SMK_HAVE_THREADS
+	struct smk_pool_job_t job;
+	unsigned long parts;
+#endif
+	/* null check */
+	assert(s);
+	s->dirty_rect_valid = 0;
+#ifdef SMK_HAVE_THREADS
+
+	if (s->pool && bh > 1) {
+		parts = (s->pool->threads + 1) * SMK_POOL_BANDS;
+		job.work = smk_pool_rows;
+		job.video = s;
+		job.cmds = c;
+		job.convert = convert;
+		job.rows = bh;
+		job.band = (bh + parts - 1) / parts;
+		smk_pool_run(s->pool, &job);
+	} else
+#endif
+		smk_video_rows(s, c, 0, bh, convert);
+
+	if (c->failed)
+		return -1;
 
+	s->palette_changed = 0;
 	return 0;
 }
 
 /* Decompress audio track i. */
 static char smk_render_audio(struct smk_audio_t * s, unsigned char * p, unsigned long size)
 {
-	unsigned int j, k;
+	unsigned int j, k, bits;
 	unsigned char * t = s->buffer;
 	struct smk_bit_t bs;
 	char bit;
@@ -1519,23 +5143,36 @@ static char smk_render_audio(struct smk_audio_t * s, unsigned char * p, unsigned
 		if (s->bitdepth != (bit == 1 ? 16 : 8))
 			fputs("libsmacker::smk_render - ERROR: 8-/16-bit mismatch\n", stderr);
 
+		/* Each tree is consulted once per sample of its channel: size its
+			lookup table to that, so short chunks don't pay for a big table. */
+		for (bits = 0, j = s->buffer_size / (s->channels * (s->bitdepth / 8)); j > 1 && bits < SMK_HUFF8_TABLE_BITS; j >>= 1)
+			bits ++;
+
 		/* build the trees */
-		smk_huff8_build(&aud_tree[0], &bs);
+		if (! smk_huff8_build(&aud_tree[0], &bs, bits))
+			goto tree_error;
+
 		j = 1;
 		k = 1;
 
 		if (s->bitdepth == 16) {
-			smk_huff8_build(&aud_tree[1], &bs);
+			if (! smk_huff8_build(&aud_tree[1], &bs, bits))
+				goto tree_error;
+
 			k = 2;
 		}
 
 		if (s->channels == 2) {
-			smk_huff8_build(&aud_tree[2], &bs);
+			if (! smk_huff8_build(&aud_tree[2], &bs, bits))
+				goto tree_error;
+
 			j = 2;
 			k = 2;
 
 			if (s->bitdepth == 16) {
-				smk_huff8_build(&aud_tree[3], &bs);
+				if (! smk_huff8_build(&aud_tree[3], &bs, bits))
+					goto tree_error;
+
 				k = 4;
 			}
 		}
@@ -1592,19 +5229,77 @@ static char smk_render_audio(struct smk_audio_t * s, unsigned char * p, unsigned
 	}
 
 	return 0;
+tree_error:
+	fputs("libsmacker::smk_render_audio() - ERROR: failed to build audio trees\n", stderr);
 error:
 	return -1;
 }
 
+#ifdef SMK_HAVE_THREADS
+/* Hand the pipeline the frame after cur_frame (or what smk_next would
+	wrap to), when its chunk is in memory: find its video record, past
+	the palette and audio ones, as smk_render does. */
+static void smk_pipe_ahead(smk s)
+{
+	unsigned long f = s->cur_frame + 1, i, size;
+	const unsigned char * p;
+	unsigned char track;
+
+	if (f >= s->f + s->ring_frame) {
+		if (! s->ring_frame)
+			return;
+
+		f = 1;
+	}
+
+	/* (progressive mode: not until everything is loaded) */
+	if (s->source.load || (i = s->chunk_size[f]) == 0 || (p = s->source.chunk_data[f]) == NULL)
+		return;
+
+	if (s->frame_type[f] & 0x01) {
+		size = 4 * (*p);
+		p += size;
+		i -= size;
+	}
+
+	for (track = 0; track < 7; track ++) {
+		if (s->frame_type[f] & (0x02 << track)) {
+			if (i < 4)
+				return;
+
+			size = (((unsigned int) p[3] << 24) |
+					((unsigned int) p[2] << 16) |
+					((unsigned int) p[1] << 8) |
+					((unsigned int) p[0]));
+			p += size;
+			i -= size;
+		}
+	}
+
+	smk_pipe_post(s->pipe, s->video.pool, f, p, i);
+}
+#endif
+
 /* "Renders" (unpacks) the frame at cur_frame
 	Preps all the image and audio pointers */
 static char smk_render(smk s)
 {
 	unsigned long i, size;
 	unsigned char * buffer = NULL, * p, track;
+	/* enabled audio tracks in this frame, and where each one's data is */
+	unsigned char audio_mask = 0, * audio_p[7];
+	unsigned long audio_size[7];
+#ifdef SMK_HAVE_THREADS
+	char r, posted = 0;
+#endif
 	/* null check */
 	assert(s);
 
+	if (s->mode == SMK_MODE_INFO) {
+		fputs("libsmacker::smk_render(s) - ERROR: smk was opened with SMK_MODE_INFO, no frames to render.\n", stderr);
+		goto error;
+	}
+
 	/* Retrieve current chunk_size for this frame. */
 	if (!(i = s->chunk_size[s->cur_frame])) {
 		fprintf(stderr, "libsmacker::smk_render(s) - Warning: frame %lu: chunk_size is 0.\n", s->cur_frame);
@@ -1612,23 +5307,26 @@ static char smk_render(smk s)
 	}
 
 	if (s->mode == SMK_MODE_DISK) {
-		/* Skip to frame in file */
-		if (fseek(s->source.file.fp, s->source.file.chunk_offset[s->cur_frame], SEEK_SET)) {
-			fprintf(stderr, "libsmacker::smk_render(s) - ERROR: fseek to frame %lu (offset %lu) failed.\n", s->cur_frame, s->source.file.chunk_offset[s->cur_frame]);
-			perror("\tError reported was");
-			goto error;
+		/* In disk-streaming mode: take the chunk from a smk_fetch
+			queue or read-ahead, or read it into the chunk buffer */
+		if (s->source.file.fetch_state == SMK_FETCH_READY && s->source.file.fetch_frame == s->cur_frame) {
+			buffer = s->source.file.fetch_buffer;
+			s->source.file.fetch_state = SMK_FETCH_NONE;
 		}
 
-		/* In disk-streaming mode: make way for our incoming chunk buffer */
-		if ((buffer = malloc(i)) == NULL) {
-			perror("libsmacker::smk_render() - ERROR: failed to malloc() buffer");
-			return -1;
-		}
+#ifdef SMK_HAVE_THREADS
+		if (buffer == NULL && s->source.file.ra)
+			buffer = smk_readahead_fetch(s->source.file.ra, s->cur_frame);
 
-		/* Read into buffer */
-		if (smk_read_file(buffer, s->chunk_size[s->cur_frame], s->source.file.fp) < 0) {
-			fprintf(stderr, "libsmacker::smk_render(s) - ERROR: frame %lu (offset %lu): smk_read had errors.\n", s->cur_frame, s->source.file.chunk_offset[s->cur_frame]);
-			goto error;
+#endif
+
+		if (buffer == NULL) {
+			buffer = s->source.file.buffer;
+
+			if (s->source.io.read_at(s->source.user, s->source.file.chunk_offset[s->cur_frame], i, buffer) < 0) {
+				fprintf(stderr, "libsmacker::smk_render(s) - ERROR: frame %lu (offset %lu): read had errors.\n", s->cur_frame, s->source.file.chunk_offset[s->cur_frame]);
+				goto error;
+			}
 		}
 	} else {
 		/* Just point buffer at the right place */
@@ -1638,6 +5336,30 @@ static char smk_render(smk s)
 		}
 
 		buffer = s->source.chunk_data[s->cur_frame];
+#ifdef SMK_HAVE_THREADS
+
+		/* progressive mode: wait for the chunk to be loaded */
+		if (s->source.load) {
+			r = smk_load_wait(s->source.load, (unsigned long)(buffer - s->source.arena) + i);
+
+			if (r < 0) {
+				fprintf(stderr, "libsmacker::smk_render(s) - ERROR: frame %lu: chunk failed to load.\n", s->cur_frame);
+				goto error;
+			}
+
+			/* all loaded: done with the loader, and with the source */
+			if (r > 0) {
+				smk_load_stop(s->source.load);
+				s->source.load = NULL;
+
+				if (s->source.io.close)
+					s->source.io.close(s->source.user);
+
+				s->source.io.close = NULL;
+			}
+		}
+
+#endif
 	}
 
 	p = buffer;
@@ -1662,7 +5384,7 @@ static char smk_render(smk s)
 		i -= size;
 	}
 
-	/* Unpack audio chunks */
+	/* Find audio chunks */
 	for (track = 0; track < 7; track ++) {
 		if (s->frame_type[s->cur_frame] & (0x02 << track)) {
 			/* need at least 4 byte to process */
@@ -1678,9 +5400,12 @@ static char smk_render(smk s)
 					((unsigned int) p[1] << 8) |
 					((unsigned int) p[0]));
 
-			/* If audio rendering enabled, kick this off for decode. */
-			if (s->audio[track].enable)
-				smk_render_audio(&s->audio[track], p + 4, size - 4);
+			/* If audio rendering enabled, queue this up for decode. */
+			if (s->audio[track].enable) {
+				audio_mask |= (1 << track);
+				audio_p[track] = p + 4;
+				audio_size[track] = size - 4;
+			}
 
 			p += size;
 			i -= size;
@@ -1688,27 +5413,60 @@ static char smk_render(smk s)
 			s->audio[track].buffer_size = 0;
 	}
 
-	/* Unpack video chunk */
+	/* Unpack audio chunks: on the audio thread, if there is one
+		(alongside the video), or here */
+#ifdef SMK_HAVE_THREADS
+	if (s->audio_worker && audio_mask && s->video.enable) {
+		smk_audio_worker_post(s->audio_worker, audio_mask, audio_p, audio_size);
+		posted = 1;
+		audio_mask = 0;
+	}
+
+#endif
+
+	for (track = 0; track < 7; track ++) {
+		if (audio_mask & (1 << track))
+			smk_render_audio(&s->audio[track], audio_p[track], audio_size[track]);
+	}
+
+	/* Unpack video chunk: the entropy stage, unless the pipeline did it already */
 	if (s->video.enable) {
-		if (smk_render_video(&(s->video), p, i) < 0) {
+#ifdef SMK_HAVE_THREADS
+		if (! s->pipe || ! smk_pipe_take(s->pipe, &s->video.cmds, s->cur_frame))
+			smk_video_entropy(&s->video, &s->video.cmds, s->video.pool, s->cur_frame, p, i);
+
+#else
+		smk_video_entropy(&s->video, &s->video.cmds, NULL, s->cur_frame, p, i);
+#endif
+
+#ifdef SMK_HAVE_THREADS
+
+		/* start the pipeline on the next frame, then reconstruct this one */
+		if (s->pipe)
+			smk_pipe_ahead(s);
+
+#endif
+
+		if (smk_video_reconstruct(&s->video, &s->video.cmds) < 0) {
 			fprintf(stderr, "libsmacker::smk_render(s) - ERROR: frame %lu: failed to render video.\n", s->cur_frame);
 			goto error;
 		}
 	}
 
-	if (s->mode == SMK_MODE_DISK) {
-		/* Remember that buffer we allocated?  Trash it */
-		smk_free(buffer);
-	}
+#ifdef SMK_HAVE_THREADS
 
+	if (posted)
+		smk_audio_worker_wait(s->audio_worker);
+
+#endif
 	return 0;
 error:
+#ifdef SMK_HAVE_THREADS
 
-	if (s->mode == SMK_MODE_DISK) {
-		/* Remember that buffer we allocated?  Trash it */
-		smk_free(buffer);
-	}
+	if (posted)
+		smk_audio_worker_wait(s->audio_worker);
 
+#endif
 	return -1;
 }
 
@@ -1787,6 +5545,14 @@ char smk_seek_keyframe(smk s, unsigned long f)
 	//while (s->cur_frame > 0 && !(s->keyframe[s->cur_frame]))
 	//	s->cur_frame --;
 
+#ifdef SMK_HAVE_MMAP
+
+	/* jumped somewhere: page in the frame about to be read */
+	if (s->mode == SMK_MODE_MMAP && f < s->f + s->ring_frame)
+		smk_map_advise(s, f, MADV_WILLNEED);
+
+#endif
+
 	/* render the frame: we're ready */
 	if (smk_render(s) < 0) {
 		fprintf(stderr, "libsmacker::smk_seek_keyframe(s,%lu) - Warning: frame %lu: smk_render returned errors.\n", f, s->cur_frame);
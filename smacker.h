@@ -25,8 +25,35 @@
 /* includes - needed for FILE* here */
 #include <stdio.h>
 
+/** Threads: libsmacker keeps no mutable global state. Each smk may be
+	used by one thread at a time (any thread, but not two at once), and
+	separate smk can be decoded on as many threads as wanted, without
+	locking. Read-ahead and progressive loading run threads of their own,
+	internally. A smk_fetch queue and the smk submitted to it are used
+	from one thread at a time, as if they were a single smk. */
+
 /** forward-declaration for an struct */
 typedef struct smk_t * smk;
+/** A pool of threads that reconstructs video frames for any number of smk */
+typedef struct smk_pool_t * smk_pool;
+/** A queue that reads chunks for many smk at once
+	(through io_uring on Linux, or with blocking reads) */
+typedef struct smk_fetch_t * smk_fetch;
+
+/** I/O callbacks for smk_open_io. "user" is passed back to each one.
+	Reads are positional, so with read-ahead on, read_at is also called
+	from the I/O thread. */
+struct smk_io_t {
+	/** read "size" bytes at "offset" into buf: 0 on success, -1 on a short read or error */
+	char (* read_at)(void * user, unsigned long offset, unsigned long size, void * buf);
+	/** total size of the source, in bytes */
+	unsigned long (* size)(void * user);
+	/** optional (NULL): memory holding "size" bytes at "offset", valid until close,
+		or NULL if it can't be had. Needed for SMK_MODE_MMAP. */
+	const unsigned char * (* map)(void * user, unsigned long offset, unsigned long size);
+	/** optional (NULL): the smk is done with "user" */
+	void (* close)(void * user);
+};
 
 /** a few defines as return codes from smk_next() */
 #define SMK_DONE	0x00
@@ -37,6 +64,26 @@ typedef struct smk_t * smk;
 /** file-processing mode, pass to smk_open_file */
 #define SMK_MODE_DISK	0x00
 #define SMK_MODE_MEMORY	0x01
+/* map the file into memory: chunks are read straight from the page cache
+	(for smk_open_io, straight from memory its map callback returns) */
+#define SMK_MODE_MMAP	0x02
+/* header only, for smk_info_*: no trees, buffers or chunks, nothing to render */
+#define SMK_MODE_INFO	0x03
+/* like SMK_MODE_MEMORY, but open returns before the chunks are read:
+	a background thread loads them in frame order, and rendering a frame
+	waits for its chunk if it hasn't arrived yet */
+#define SMK_MODE_PROGRESSIVE	0x04
+
+/** video output formats, pass to smk_set_video_format */
+#define SMK_VIDEO_INDEXED	0x00
+/* bytes R, G, B, A */
+#define SMK_VIDEO_RGBA8888	0x01
+/* native-endian 32-bit 0xAARRGGBB (alpha 0xFF, but see SMK_VIDEO_COLORKEY) */
+#define SMK_VIDEO_ARGB8888	0x02
+/* native-endian 16-bit, 5-6-5 */
+#define SMK_VIDEO_RGB565	0x03
+/* OR with a 32-bit format: palette index 0 gets alpha 0 */
+#define SMK_VIDEO_COLORKEY	0x80
 
 /** Y-scale meanings */
 #define	SMK_FLAG_Y_NONE	0x00
@@ -61,10 +108,17 @@ extern "C" {
 /* OPEN OPERATIONS */
 /** open an smk (from a file) */
 smk smk_open_file(const char * filename, unsigned char mode);
-/** open an smk (from a file pointer) */
+/** open an smk (from a file pointer). One that can't seek (a pipe, stdin)
+	is read front to back: not in SMK_MODE_DISK or SMK_MODE_MMAP. */
 smk smk_open_filepointer(FILE * file, unsigned char mode);
+/** open an smk through I/O callbacks (copied; "user" is closed with the smk,
+	or right away if opening fails) */
+smk smk_open_io(const struct smk_io_t * io, void * user, unsigned char mode);
 /** read an smk (from a memory buffer) */
 smk smk_open_memory(const unsigned char * buffer, unsigned long size);
+/** read an smk (from a memory buffer) without copying it:
+	the buffer must stay valid and unchanged until smk_close */
+smk smk_open_memory_borrowed(const unsigned char * buffer, unsigned long size);
 
 /* CLOSE OPERATIONS */
 /** close out an smk file and clean up memory */
@@ -74,16 +128,99 @@ void smk_close(smk object);
 char smk_info_all(const smk object, unsigned long * frame, unsigned long * frame_count, double * usf);
 char smk_info_video(const smk object, unsigned long * w, unsigned long * h, unsigned char * y_scale_mode);
 char smk_info_audio(const smk object, unsigned char * track_mask, unsigned char channels[7], unsigned char bitdepth[7], unsigned long audio_rate[7]);
+/** Retrieve per-frame keyframe flags (frame_count entries, nonzero for a keyframe) */
+const unsigned char * smk_info_keyframes(const smk object);
 
 /* ENABLE/DISABLE Switches */
 char smk_enable_all(smk object, unsigned char mask);
 char smk_enable_video(smk object, unsigned char enable);
 char smk_enable_audio(smk object, unsigned char track, unsigned char enable);
 
+/* READ-AHEAD (SMK_MODE_DISK) */
+/** Read up to "window" chunks ahead of playback on a background thread, into
+	a buffer of "budget" bytes (0: room for window of the largest chunk).
+	Seeking restarts it from the new frame. window 0 turns it off. */
+char smk_set_readahead(smk object, unsigned long window, unsigned long budget);
+/** Chunks that read-ahead had ready when asked for, and ones it didn't */
+char smk_get_readahead_stats(const smk object, unsigned long * hits, unsigned long * misses);
+
+/* AUDIO THREAD */
+/** Decode each frame's audio on a thread of the smk's own, while the
+	calling thread decodes its video (both are done when smk_render
+	returns). enable 0 stops the thread. */
+char smk_set_audio_thread(smk object, unsigned char enable);
+
+/* VIDEO PIPELINE (in-memory modes) */
+/** Split video decoding over two threads: while a frame's blocks are
+	written, a thread of the smk's own decodes the next frame's bitstream.
+	Frames are rendered in play order to benefit. enable 0 stops it. */
+char smk_set_pipeline(smk object, unsigned char enable);
+
+/* RECONSTRUCTION POOL */
+/** open a pool of "threads" threads, to share between smk. Unlike an smk,
+	a pool may be used from many threads at once. */
+smk_pool smk_pool_open(unsigned int threads);
+/** close a pool: every smk using it must be closed, or set to another, first */
+void smk_pool_close(smk_pool pool);
+/** Write each frame's blocks in bands of block rows, in parallel on a pool
+	(the rendering thread takes bands too). NULL: on the rendering thread. */
+char smk_set_pool(smk object, smk_pool pool);
+
+/* ENTROPY INDEX */
+/** Index frames as they are first decoded: a checkpoint every "interval"
+	block rows (4 pixel rows each). Indexed frames decode their bitstream
+	in slices, in parallel on the smk's pool. interval 0 drops the index. */
+char smk_set_index(smk object, unsigned long interval);
+/** Frames indexed, and frames decoded in slices so far */
+char smk_get_index_stats(const smk object, unsigned long * indexed, unsigned long * sliced);
+/** save the index to a (sidecar) file */
+char smk_save_index(const smk object, const char * filename);
+/** load an index saved from the same file, replacing any there is (and its
+	interval). Each frame is checked against the index when first decoded. */
+char smk_load_index(smk object, const char * filename);
+
+/* FETCH QUEUE (SMK_MODE_DISK) */
+/** open a fetch queue, with room for "depth" reads in flight or uncollected */
+smk_fetch smk_fetch_open(unsigned int depth);
+/** close a fetch queue, waiting for reads still in flight */
+void smk_fetch_close(smk_fetch queue);
+/** start reading the chunk for frame N of an smk (one read per smk at a time).
+	Once it has arrived, rendering frame N decodes from it without any I/O. */
+char smk_fetch_submit(smk_fetch queue, smk object, unsigned long frame);
+/** wait for a read to finish, and return its smk and frame
+	(NULL if there are no reads left) */
+smk smk_fetch_wait(smk_fetch queue, unsigned long * frame);
+
 /** Retrieve palette */
 const unsigned char * smk_get_palette(const smk object);
-/** Retrieve video frame, as a buffer of size w*h */
+/** Retrieve palette as 256 RGBA entries (alpha 0 for index 0 with SMK_VIDEO_COLORKEY) */
+const unsigned char * smk_get_palette_rgba(const smk object);
+/** Retrieve video frame: h rows of w pixels, smk_get_video_stride bytes
+	apart (or the buffer given to smk_set_video_target, if any).
+	Rows are padded to a multiple of 4 pixels: with the default
+	SMK_VIDEO_INDEXED output and w a multiple of 4, a buffer of size w*h. */
 const unsigned char * smk_get_video(const smk object);
+/** Bytes from the start of one row of smk_get_video to the next */
+unsigned long smk_get_video_stride(const smk object);
+/** Decode video straight into a caller-owned buffer, rows "stride" bytes apart
+	(stride >= w rounded up to a multiple of 4, times bytes per pixel).
+	The buffer must hold stride * h bytes, h rounded up to a multiple of
+	4 rows, and must keep its contents between frames: unchanged blocks
+	are not rewritten. The last decoded frame is copied in when the
+	target is set. Pass NULL to go back to the internal buffer. */
+char smk_set_video_target(smk object, unsigned char * buffer, unsigned long stride);
+/** Choose the pixel format smk_get_video / the video target receive (SMK_VIDEO_*).
+	Color formats are converted as blocks are decoded, no second pass needed. */
+char smk_set_video_format(smk object, unsigned char format);
+/** Did the current frame carry a palette record (frame_type bit 0)?
+	Color formats are then reconverted everywhere, changed blocks or not. */
+char smk_get_palette_changed(const smk object);
+/** Retrieve which 4x4 blocks the last decoded frame wrote: (w+3)/4 by (h+3)/4
+	bytes, row by row, nonzero where the block changed */
+const unsigned char * smk_get_video_dirty(const smk object);
+/** Retrieve the changed blocks as a short list of rectangles: returns the count,
+	and points rect at x, y, w, h (in pixels) for each */
+unsigned long smk_get_video_dirty_rects(const smk object, const unsigned long ** rect);
 /** Retrieve decoded audio chunk, track N */
 const unsigned char * smk_get_audio(const smk object, unsigned char track);
 /** Get size of currently pointed decoded audio chunk, track N */
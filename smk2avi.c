@@ -36,7 +36,7 @@ void process(const char *fn)
 	unsigned long temp_u;
 
 	/* all and video info */
-	unsigned long	w, h, f;
+	unsigned long	w, h, f, stride;
 	double usf;
 	unsigned long total_frame_size;
 
@@ -261,6 +261,7 @@ printf("-> Audio header %d, %luhz, %d bits, %d channels\n",i,a_r[i],a_d[i],a_c[i
 			lu(total_frame_size);
 
 			frame = smk_get_video(s);
+			stride = smk_get_video_stride(s);
 			pal = smk_get_palette(s);
 
 			if (frame == NULL || pal == NULL) goto error;
@@ -269,9 +270,9 @@ printf("-> Audio header %d, %luhz, %d bits, %d channels\n",i,a_r[i],a_d[i],a_c[i
 			{
 				for (k = 0; k < w; k++)
 				{
-					w(&pal[frame[(j * w) + k] * 3 + 2],1);
-					w(&pal[frame[(j * w) + k] * 3 + 1],1);
-					w(&pal[frame[(j * w) + k] * 3],1);
+					w(&pal[frame[(j * stride) + k] * 3 + 2],1);
+					w(&pal[frame[(j * stride) + k] * 3 + 1],1);
+					w(&pal[frame[(j * stride) + k] * 3],1);
 				}
 			}
 			printf("%u...",i);
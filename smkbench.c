@@ -0,0 +1,254 @@
+/*
+ * libsmacker - A C library for decoding .smk Smacker Video files
+ * Copyright (C) 2012-2021 Greg Kennedy
+ *
+ * See smacker.h for more information.
+ *
+ * smkbench.c
+ *	Multi-handle scaling benchmark: decodes 1, 2, 4 ... N handles,
+ *	each on its own thread, and reports aggregate frames per second.
+ *	Files are loaded once; every handle opens its own copy.
+ */
+
+#include "smacker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(SMK_NO_THREADS) && (defined(__unix__) || defined(__APPLE__))
+	#define SMKBENCH_THREADS
+	#include <pthread.h>
+#endif
+
+/* a file, read into memory */
+struct file {
+	unsigned char * data;
+	unsigned long size;
+};
+
+/* one thread's handle, and what it got through */
+struct job {
+	const struct file * file;
+	unsigned long loops;
+	unsigned long frames;
+	int failed;
+	int started;
+};
+
+/* -a: decode audio on a thread of each handle's own;
+	-p: and pipeline video entropy decoding on another */
+static int audio_thread, pipeline;
+/* -r: reconstruct on a pool shared by every handle */
+static smk_pool pool;
+/* -i: index frames every this many block rows (so loops after the first decode in slices) */
+static unsigned long index_rows;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* decode every frame of a handle (video and all audio), "loops" times */
+static void * decode(void * arg)
+{
+	struct job * j = arg;
+	unsigned long l, f, frame_count;
+	smk s;
+
+	if ((s = smk_open_memory(j->file->data, j->file->size)) == NULL) {
+		j->failed = 1;
+		return NULL;
+	}
+
+	smk_info_all(s, NULL, &frame_count, NULL);
+	smk_enable_all(s, 0xFF);
+
+	if (audio_thread && smk_set_audio_thread(s, 1) < 0)
+		j->failed = 1;
+
+	if (pipeline && smk_set_pipeline(s, 1) < 0)
+		j->failed = 1;
+
+	if (pool && smk_set_pool(s, pool) < 0)
+		j->failed = 1;
+
+	if (index_rows && smk_set_index(s, index_rows) < 0)
+		j->failed = 1;
+
+	for (l = 0; l < j->loops; l ++) {
+		if (smk_first(s) < 0)
+			j->failed = 1;
+
+		for (f = 1; f < frame_count; f ++) {
+			if (smk_next(s) < 0)
+				j->failed = 1;
+		}
+
+		j->frames += frame_count;
+	}
+
+	smk_close(s);
+	return NULL;
+}
+
+/* decode "n" handles at once, and print how fast it went */
+static int run(const struct file * files, const unsigned long file_count, const unsigned long n, const unsigned long loops, double * base)
+{
+	struct job * job;
+	unsigned long i, frames = 0;
+	double t, fps;
+	int failed = 0;
+#ifdef SMKBENCH_THREADS
+	pthread_t * thread;
+#endif
+
+	if ((job = calloc(n, sizeof(struct job))) == NULL) {
+		perror("smkbench: calloc");
+		return -1;
+	}
+
+	for (i = 0; i < n; i ++) {
+		job[i].file = &files[i % file_count];
+		job[i].loops = loops;
+	}
+
+	t = now();
+#ifdef SMKBENCH_THREADS
+
+	if ((thread = malloc(n * sizeof(pthread_t))) == NULL) {
+		perror("smkbench: malloc");
+		free(job);
+		return -1;
+	}
+
+	for (i = 0; i < n; i ++)
+		job[i].started = ! pthread_create(&thread[i], NULL, decode, &job[i]);
+
+	/* (a thread that won't start is run here, after the others) */
+	for (i = 0; i < n; i ++) {
+		if (job[i].started)
+			pthread_join(thread[i], NULL);
+		else
+			decode(&job[i]);
+	}
+
+	free(thread);
+#else
+
+	for (i = 0; i < n; i ++)
+		decode(&job[i]);
+
+#endif
+	t = now() - t;
+
+	for (i = 0; i < n; i ++) {
+		frames += job[i].frames;
+		failed |= job[i].failed;
+	}
+
+	fps = frames / t;
+
+	if (*base == 0)
+		*base = fps;
+
+	printf("%8lu %12lu %10.3f %14.1f %8.2fx%s\n", n, frames, t, fps, fps / *base, failed ? "  (errors)" : "");
+	free(job);
+	return failed;
+}
+
+int main(int argc, char * argv[])
+{
+	struct file * files;
+	unsigned long file_count = 0, threads = 16, loops = 10, n;
+	double base = 0;
+	int a, failed = 0;
+	FILE * fp;
+	long size;
+
+	if ((files = calloc(argc, sizeof(struct file))) == NULL) {
+		perror("smkbench: calloc");
+		return EXIT_FAILURE;
+	}
+
+	for (a = 1; a < argc; a ++) {
+		if (!strcmp(argv[a], "-t") && a + 1 < argc)
+			threads = strtoul(argv[++ a], NULL, 10);
+		else if (!strcmp(argv[a], "-l") && a + 1 < argc)
+			loops = strtoul(argv[++ a], NULL, 10);
+		else if (!strcmp(argv[a], "-a"))
+			audio_thread = 1;
+		else if (!strcmp(argv[a], "-p"))
+			pipeline = 1;
+		else if (!strcmp(argv[a], "-i") && a + 1 < argc)
+			index_rows = strtoul(argv[++ a], NULL, 10);
+		else if (!strcmp(argv[a], "-r") && a + 1 < argc) {
+			if ((pool = smk_pool_open(strtoul(argv[++ a], NULL, 10))) == NULL)
+				return EXIT_FAILURE;
+		}
+		else if (!strcmp(argv[a], "-h")) {
+			printf("Usage: %s [-t threads] [-l loops] [-a] [-p] [-r threads] [-i rows] file.smk ...\n"
+				"\tDecodes 1, 2, 4 ... threads handles at once, one per thread,\n"
+				"\teach playing its file (in turn from the list) loops times.\n"
+				"\t-a: each handle decodes audio on a thread of its own.\n"
+				"\t-p: each handle pipelines video decoding (smk_set_pipeline).\n"
+				"\t-r: handles share a pool of this many threads for reconstruction.\n"
+				"\t-i: each handle indexes its frames every this many block rows,\n"
+				"\t    and decodes them in slices on the pool (-r) from then on.\n", argv[0]);
+			return 0;
+		} else {
+			/* load the file */
+			if ((fp = fopen(argv[a], "rb")) == NULL) {
+				perror(argv[a]);
+				return EXIT_FAILURE;
+			}
+
+			fseek(fp, 0, SEEK_END);
+			size = ftell(fp);
+			fseek(fp, 0, SEEK_SET);
+
+			if (size <= 0 || (files[file_count].data = malloc(size)) == NULL ||
+				fread(files[file_count].data, 1, size, fp) != (size_t)size) {
+				fprintf(stderr, "smkbench: could not read %s\n", argv[a]);
+				return EXIT_FAILURE;
+			}
+
+			fclose(fp);
+			files[file_count].size = size;
+			file_count ++;
+		}
+	}
+
+	if (file_count == 0) {
+		fprintf(stderr, "Usage: %s [-t threads] [-l loops] [-a] [-p] [-r threads] [-i rows] file.smk ...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (threads < 1)
+		threads = 1;
+
+	printf("%8s %12s %10s %14s %9s\n", "handles", "frames", "seconds", "frames/sec", "scaling");
+
+	for (n = 1; ; n *= 2) {
+		if (n > threads)
+			n = threads;
+
+		failed |= run(files, file_count, n, loops, &base);
+
+		if (n == threads)
+			break;
+	}
+
+	if (pool)
+		smk_pool_close(pool);
+
+	for (n = 0; n < file_count; n ++)
+		free(files[n].data);
+
+	free(files);
+	return failed ? EXIT_FAILURE : 0;
+}
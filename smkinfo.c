@@ -0,0 +1,254 @@
+/*
+ * libsmacker - A C library for decoding .smk Smacker Video files
+ * Copyright (C) 2012-2021 Greg Kennedy
+ *
+ * See smacker.h for more information.
+ *
+ * smkinfo.c
+ *	Catalog scanner: prints one line of metadata per .smk file,
+ *	as JSON or TSV, reading only headers (SMK_MODE_INFO).
+ *	Files come from the command line, or one per line on stdin.
+ */
+
+#include "smacker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(SMK_NO_THREADS) && (defined(__unix__) || defined(__APPLE__))
+	#define SMKINFO_THREADS
+	#include <pthread.h>
+#endif
+
+/* one file's line of output */
+struct entry {
+	char * name;
+	char * line;
+};
+
+static struct entry * entries;
+static unsigned long entry_count;
+static int json = 1;
+
+#ifdef SMKINFO_THREADS
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static unsigned long next_entry;
+
+/* append, growing the buffer as needed */
+static void put(char ** buf, size_t * len, size_t * size, const char * s)
+{
+	const size_t n = strlen(s);
+
+	if (*len + n + 1 > *size) {
+		*size = (*len + n + 1) * 2;
+
+		if ((*buf = realloc(*buf, *size)) == NULL) {
+			perror("smkinfo: realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memcpy(*buf + *len, s, n + 1);
+	*len += n;
+}
+
+/* file name, quoted for JSON or cleaned up for TSV */
+static void put_name(char ** buf, size_t * len, size_t * size, const char * name)
+{
+	char c[8];
+
+	if (json)
+		put(buf, len, size, "\"");
+
+	for (; *name; name ++) {
+		if (json && (*name == '"' || *name == '\\'))
+			sprintf(c, "\\%c", *name);
+		else if ((unsigned char)*name < 0x20)
+			sprintf(c, json ? "\\u%04x" : " ", (unsigned char)*name);
+		else
+			sprintf(c, "%c", *name);
+
+		put(buf, len, size, c);
+	}
+
+	if (json)
+		put(buf, len, size, "\"");
+}
+
+/* open one file header-only, and describe it */
+static char * describe(const char * name)
+{
+	char * buf = NULL, tmp[128];
+	size_t len = 0, size = 0;
+	unsigned long frame, frame_count, w, h, keyframes = 0, rate[7], i;
+	double usf;
+	unsigned char y_scale, mask, channels[7], bitdepth[7];
+	const unsigned char * keyframe;
+	smk s;
+
+	if (json)
+		put(&buf, &len, &size, "{\"file\":");
+
+	put_name(&buf, &len, &size, name);
+
+	if ((s = smk_open_file(name, SMK_MODE_INFO)) == NULL) {
+		put(&buf, &len, &size, json ? ",\"error\":\"open failed\"}" : "\terror");
+		return buf;
+	}
+
+	smk_info_all(s, &frame, &frame_count, &usf);
+	smk_info_video(s, &w, &h, &y_scale);
+	smk_info_audio(s, &mask, channels, bitdepth, rate);
+	keyframe = smk_info_keyframes(s);
+
+	for (i = 0; i < frame_count; i ++)
+		keyframes += (keyframe[i] != 0);
+
+	sprintf(tmp, json ? ",\"width\":%lu,\"height\":%lu,\"y_scale\":%u,\"frames\":%lu,\"fps\":%.3f,\"keyframes\":%lu,\"audio\":[" : "\t%lu\t%lu\t%u\t%lu\t%.3f\t%lu\t",
+		w, h, y_scale, frame_count, 1000000.0 / usf, keyframes);
+	put(&buf, &len, &size, tmp);
+
+	for (i = 0; i < 7; i ++) {
+		if (!(mask & (1 << i)))
+			continue;
+
+		if (json)
+			sprintf(tmp, "%s{\"track\":%lu,\"channels\":%u,\"bits\":%u,\"rate\":%lu}", (mask & ((1 << i) - 1)) ? "," : "", i, channels[i], bitdepth[i], rate[i]);
+		else
+			sprintf(tmp, "%s%lu:%ux%u@%lu", (mask & ((1 << i) - 1)) ? "," : "", i, channels[i], bitdepth[i], rate[i]);
+
+		put(&buf, &len, &size, tmp);
+	}
+
+	if (json)
+		put(&buf, &len, &size, "]}");
+	else if (!mask)
+		put(&buf, &len, &size, "-");
+
+	smk_close(s);
+	return buf;
+}
+
+/* worker: describe files until there are none left */
+static void * scan(void * arg)
+{
+	unsigned long i;
+	(void)arg;
+
+	for (;;) {
+#ifdef SMKINFO_THREADS
+		pthread_mutex_lock(&next_lock);
+#endif
+		i = next_entry ++;
+#ifdef SMKINFO_THREADS
+		pthread_mutex_unlock(&next_lock);
+#endif
+
+		if (i >= entry_count)
+			return NULL;
+
+		entries[i].line = describe(entries[i].name);
+	}
+}
+
+static void add(const char * name)
+{
+	static unsigned long size = 0;
+
+	if (entry_count == size) {
+		size = size ? size * 2 : 256;
+
+		if ((entries = realloc(entries, size * sizeof(struct entry))) == NULL) {
+			perror("smkinfo: realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((entries[entry_count].name = malloc(strlen(name) + 1)) == NULL) {
+		perror("smkinfo: malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	strcpy(entries[entry_count].name, name);
+	entries[entry_count].line = NULL;
+	entry_count ++;
+}
+
+int main(int argc, char * argv[])
+{
+	unsigned long jobs = 4, i;
+	char line[4096];
+	int a;
+	size_t n;
+#ifdef SMKINFO_THREADS
+	pthread_t * thread;
+#endif
+
+	for (a = 1; a < argc; a ++) {
+		if (!strcmp(argv[a], "-j") && a + 1 < argc)
+			jobs = strtoul(argv[++ a], NULL, 10);
+		else if (!strcmp(argv[a], "-t"))
+			json = 0;
+		else if (!strcmp(argv[a], "-h")) {
+			printf("Usage: %s [-j jobs] [-t] [file.smk ...]\n"
+				"\tPrints a JSON line (-t: a TSV line) per file.\n"
+				"\tWith no files given, reads names from stdin, one per line.\n", argv[0]);
+			return 0;
+		} else
+			add(argv[a]);
+	}
+
+	if (entry_count == 0) {
+		while (fgets(line, sizeof(line), stdin)) {
+			n = strlen(line);
+
+			while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+				line[-- n] = '\0';
+
+			if (n > 0)
+				add(line);
+		}
+	}
+
+	if (jobs < 1)
+		jobs = 1;
+
+#ifdef SMKINFO_THREADS
+
+	if ((thread = malloc(jobs * sizeof(pthread_t))) == NULL) {
+		perror("smkinfo: malloc");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < jobs; i ++) {
+		if (pthread_create(&thread[i], NULL, scan, NULL)) {
+			jobs = i;
+			break;
+		}
+	}
+
+	/* (if no thread would start, do it here) */
+	scan(NULL);
+
+	for (i = 0; i < jobs; i ++)
+		pthread_join(thread[i], NULL);
+
+	free(thread);
+#else
+	scan(NULL);
+#endif
+
+	if (!json)
+		puts("file\twidth\theight\ty_scale\tframes\tfps\tkeyframes\taudio");
+
+	for (i = 0; i < entry_count; i ++) {
+		puts(entries[i].line);
+		free(entries[i].line);
+		free(entries[i].name);
+	}
+
+	free(entries);
+	return 0;
+}